@@ -0,0 +1,530 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Measure how long the AT sequences take against the modem simulator: the
+ * simulator given on the command line is started on a temporary
+ * pseudo-terminal, then once it sends RDY, the AT code runs:
+ *   - the configure sequence, which fixes the simulator's factory settings
+ *   - the configure sequence again, which must not change any setting as all
+ *     `expect` values now match
+ *   - if `--mismatch` is given, that command followed by the configure
+ *     sequence, which must only change the setting it altered
+ *   - a few suspend/resume cycles
+ *
+ * The time taken by each step is printed, and the exit status is non-zero if
+ * any of them doesn't complete or changes unexpected settings, so this can be
+ * run as a test.
+ *
+ * Settings changes are detected from the commands written to the modem, as
+ * the AT code reports them through at_trace_record(): at-trace.c isn't used.
+ */
+
+#define _GNU_SOURCE
+
+#include "at.h"
+#include "at-stubs.h"
+#include "at-trace.h"
+#include "manager.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+
+// Give up waiting for the simulator to create its pseudo-terminal after this many ms
+#define BENCH_SIM_TIMEOUT 5000
+// Give up waiting for a step to complete after this many ms
+#define BENCH_STEP_TIMEOUT 60000
+
+enum BenchStep {
+    BENCH_BOOT = 0,
+    BENCH_CONFIGURE,
+    BENCH_RECONFIGURE,
+    BENCH_MISMATCH,
+    BENCH_SUSPEND,
+    BENCH_RESUME,
+    BENCH_DONE,
+};
+
+/*
+ * Sequences queued from the bench are followed by a bare "AT" request, which
+ * is only sent once they are complete: the step ends when it's written.
+ */
+struct Bench {
+    struct EG25Manager manager;
+    enum BenchStep step;
+    gint64 step_start;
+    gint64 step_end;
+    gboolean barrier;
+    guint cycle;
+    guint cycles;
+    guint timeout_timer;
+    gboolean failed;
+
+    GString *tx;
+    // Commands of the configure sequence having an `expect` value
+    GHashTable *expect_keys;
+    guint expect_writes;
+    gchar *mismatch_cmd;
+    gchar *mismatch_key;
+    gboolean mismatch_written;
+};
+
+static const char *step_names[] = {
+    [BENCH_BOOT] = "boot",
+    [BENCH_CONFIGURE] = "configure",
+    [BENCH_RECONFIGURE] = "reconfigure",
+    [BENCH_MISMATCH] = "mismatch",
+    [BENCH_SUSPEND] = "suspend",
+    [BENCH_RESUME] = "resume",
+};
+
+static void bench_start_step(struct Bench *bench, enum BenchStep step);
+
+/*
+ * Return the command and subcommand (e.g. "QCFG/ims") changed by `cmd`, a
+ * command without its "AT" prefix, or NULL if it isn't a set command
+ */
+static gchar *get_set_key(const char *cmd)
+{
+    const char *name, *args, *end;
+
+    if (cmd[0] != '+')
+        return NULL;
+
+    name = cmd + 1;
+    args = strchr(name, '=');
+    if (!args)
+        return NULL;
+
+    if (args[1] != '"')
+        return g_strndup(name, args - name);
+
+    // Setting name only, e.g. +QCFG="ims", is a query
+    end = strchr(args + 2, '"');
+    if (!end || end[1] != ',')
+        return NULL;
+
+    return g_strdup_printf("%.*s/%.*s", (int)(args - name), name,
+                           (int)(end - args - 2), args + 2);
+}
+
+static void bench_tx_line(struct Bench *bench, const char *line)
+{
+    g_auto(GStrv) cmds = NULL;
+
+    if (!g_str_has_prefix(line, "AT"))
+        return;
+
+    if (bench->barrier && strcmp(line, "AT") == 0) {
+        bench->step_end = g_get_monotonic_time();
+        bench->barrier = FALSE;
+        return;
+    }
+
+    // Batched commands are separated by semicolons
+    cmds = g_strsplit(line + 2, ";", -1);
+    for (guint i = 0; cmds[i]; i++) {
+        g_autofree gchar *key = get_set_key(cmds[i]);
+
+        if (!key || !g_hash_table_contains(bench->expect_keys, key))
+            continue;
+
+        bench->expect_writes++;
+        if (g_strcmp0(key, bench->mismatch_key) == 0)
+            bench->mismatch_written = TRUE;
+    }
+}
+
+/*
+ * Trace functions used by the AT code: the bench is the manager's container
+ */
+void at_trace_init(toml_table_t *config) {}
+void at_trace_destroy(void) {}
+void at_trace_sequence(struct EG25Manager *manager, enum AtTraceSequence sequence) {}
+void at_trace_wake(struct EG25Manager *manager, guint64 latency) {}
+
+void at_trace_record(struct EG25Manager *manager,
+                     enum AtTraceType    type,
+                     const void         *data,
+                     gsize               len)
+{
+    struct Bench *bench = (struct Bench *)manager;
+    const char *end;
+
+    if (type != AT_TRACE_TX)
+        return;
+
+    g_string_append_len(bench->tx, data, len);
+    while ((end = memchr(bench->tx->str, '\n', bench->tx->len))) {
+        g_autofree gchar *line = g_strndup(bench->tx->str, end - bench->tx->str);
+
+        g_strchomp(line);
+        bench_tx_line(bench, line);
+        g_string_erase(bench->tx, 0, end - bench->tx->str + 1);
+    }
+}
+
+static gboolean bench_timeout(struct Bench *bench)
+{
+    g_warning("Step '%s' didn't complete within %d ms", step_names[bench->step],
+              BENCH_STEP_TIMEOUT);
+    bench->timeout_timer = 0;
+    bench->failed = TRUE;
+    g_main_loop_quit(bench->manager.loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean bench_check_step(struct Bench *bench)
+{
+    switch (bench->step) {
+    case BENCH_CONFIGURE:
+        if (bench->manager.modem_state != EG25_STATE_CONFIGURED) {
+            g_warning("Modem not configured after the configure sequence");
+            return FALSE;
+        }
+        g_print("configure: %u settings changed\n", bench->expect_writes);
+        break;
+    case BENCH_RECONFIGURE:
+        if (bench->expect_writes > 0) {
+            g_warning("Configure sequence changed %u settings, none expected",
+                      bench->expect_writes);
+            return FALSE;
+        }
+        break;
+    case BENCH_MISMATCH:
+        if (!bench->mismatch_written || bench->expect_writes != 1) {
+            g_warning("Configure sequence changed %u settings, only %s expected",
+                      bench->expect_writes, bench->mismatch_key);
+            return FALSE;
+        }
+        break;
+    default:
+        break;
+    }
+
+    return TRUE;
+}
+
+static gboolean bench_next_step(struct Bench *bench)
+{
+    switch (bench->step) {
+    case BENCH_BOOT:
+        bench_start_step(bench, BENCH_CONFIGURE);
+        break;
+    case BENCH_CONFIGURE:
+        bench_start_step(bench, BENCH_RECONFIGURE);
+        break;
+    case BENCH_RECONFIGURE:
+        if (bench->mismatch_cmd) {
+            bench_start_step(bench, BENCH_MISMATCH);
+            break;
+        }
+        // fall through
+    case BENCH_MISMATCH:
+        bench_start_step(bench, bench->cycles > 0 ? BENCH_SUSPEND : BENCH_DONE);
+        break;
+    case BENCH_SUSPEND:
+        bench_start_step(bench, BENCH_RESUME);
+        break;
+    case BENCH_RESUME:
+        bench->cycle++;
+        bench_start_step(bench, bench->cycle < bench->cycles ? BENCH_SUSPEND : BENCH_DONE);
+        break;
+    default:
+        break;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static void bench_step_done(struct Bench *bench)
+{
+    gint64 end = bench->step_end ? bench->step_end : g_get_monotonic_time();
+    double elapsed = (end - bench->step_start) / 1000.0;
+
+    if (bench->step == BENCH_SUSPEND || bench->step == BENCH_RESUME)
+        g_print("%s %u: %.1f ms\n", step_names[bench->step], bench->cycle + 1, elapsed);
+    else
+        g_print("%s: %.1f ms\n", step_names[bench->step], elapsed);
+
+    if (!bench_check_step(bench))
+        bench->failed = TRUE;
+
+    g_source_remove(bench->timeout_timer);
+    bench->timeout_timer = g_timeout_add(BENCH_STEP_TIMEOUT, G_SOURCE_FUNC(bench_timeout), bench);
+
+    // We may be called from within the AT code, let it complete first
+    g_idle_add(G_SOURCE_FUNC(bench_next_step), bench);
+}
+
+static void bench_barrier_done(struct EG25Manager *manager,
+                               const char         *response,
+                               const char         *error,
+                               gpointer            user_data)
+{
+    struct Bench *bench = user_data;
+
+    if (error) {
+        g_warning("Step '%s' failed: %s", step_names[bench->step], error);
+        bench->failed = TRUE;
+        g_main_loop_quit(manager->loop);
+        return;
+    }
+
+    bench_step_done(bench);
+}
+
+static void bench_barrier(struct Bench *bench)
+{
+    bench->barrier = TRUE;
+    if (!at_request_async(&bench->manager, "", 0, bench_barrier_done, bench))
+        bench_barrier_done(&bench->manager, NULL, "QUEUE FULL", bench);
+}
+
+static void bench_configure(struct Bench *bench)
+{
+    bench->step_start = g_get_monotonic_time();
+    bench->expect_writes = 0;
+    bench->mismatch_written = FALSE;
+    at_sequence_configure(&bench->manager);
+    bench_barrier(bench);
+}
+
+static void bench_mismatch_done(struct EG25Manager *manager,
+                                const char         *response,
+                                const char         *error,
+                                gpointer            user_data)
+{
+    struct Bench *bench = user_data;
+
+    if (error) {
+        g_warning("Command %s failed: %s", bench->mismatch_cmd, error);
+        bench->failed = TRUE;
+        g_main_loop_quit(manager->loop);
+        return;
+    }
+
+    bench_configure(bench);
+}
+
+static void bench_stub_event(struct EG25Manager *manager, enum AtStubEvent event)
+{
+    struct Bench *bench = (struct Bench *)manager;
+
+    if ((event == AT_STUB_STARTED && bench->step == BENCH_BOOT) ||
+        (event == AT_STUB_SUSPENDED && bench->step == BENCH_SUSPEND))
+        bench_step_done(bench);
+}
+
+static void bench_start_step(struct Bench *bench, enum BenchStep step)
+{
+    bench->step = step;
+    bench->step_start = g_get_monotonic_time();
+    bench->step_end = 0;
+
+    switch (step) {
+    case BENCH_CONFIGURE:
+    case BENCH_RECONFIGURE:
+        bench_configure(bench);
+        break;
+    case BENCH_MISMATCH:
+        if (!at_request_async(&bench->manager, bench->mismatch_cmd, 0, bench_mismatch_done, bench))
+            bench_mismatch_done(&bench->manager, NULL, "QUEUE FULL", bench);
+        break;
+    case BENCH_SUSPEND:
+        bench->manager.modem_state = EG25_STATE_SUSPENDING;
+        at_sequence_suspend(&bench->manager);
+        break;
+    case BENCH_RESUME:
+        bench->manager.modem_state = EG25_STATE_RESUMING;
+        at_sequence_resume(&bench->manager);
+        bench_barrier(bench);
+        break;
+    case BENCH_DONE:
+        g_main_loop_quit(bench->manager.loop);
+        break;
+    default:
+        break;
+    }
+}
+
+// Collect the commands of the configure sequence having an `expect` value
+static void load_expect_keys(struct Bench *bench, toml_table_t *config)
+{
+    toml_array_t *commands = toml_array_in(config, "configure");
+
+    bench->expect_keys = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+    for (int i = 0; commands && i < toml_array_nelem(commands); i++) {
+        toml_table_t *command = toml_table_at(commands, i);
+        toml_datum_t cmd = toml_string_in(command, "cmd");
+        toml_datum_t subcmd = toml_string_in(command, "subcmd");
+        toml_datum_t expect = toml_string_in(command, "expect");
+
+        if (cmd.ok && expect.ok) {
+            if (subcmd.ok)
+                g_hash_table_add(bench->expect_keys, g_strdup_printf("%s/%s", cmd.u.s, subcmd.u.s));
+            else
+                g_hash_table_add(bench->expect_keys, g_strdup(cmd.u.s));
+        }
+
+        if (cmd.ok)
+            free(cmd.u.s);
+        if (subcmd.ok)
+            free(subcmd.u.s);
+        if (expect.ok)
+            free(expect.u.s);
+    }
+}
+
+// Start the simulator, creating its AT port as `port`
+static gboolean spawn_simulator(gchar **sim_argv, const char *port, GPid *pid)
+{
+    g_autoptr(GPtrArray) argv = g_ptr_array_new();
+    g_autoptr(GError) err = NULL;
+    gint waited = 0;
+
+    for (guint i = 0; sim_argv[i]; i++)
+        g_ptr_array_add(argv, sim_argv[i]);
+    g_ptr_array_add(argv, "--link");
+    g_ptr_array_add(argv, (gpointer)port);
+    g_ptr_array_add(argv, NULL);
+
+    if (!g_spawn_async(NULL, (gchar **)argv->pdata, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                       NULL, NULL, pid, &err)) {
+        g_warning("Unable to start the simulator: %s", err->message);
+        return FALSE;
+    }
+
+    // The main loop isn't running yet, there's nothing else to do meanwhile
+    while (!g_file_test(port, G_FILE_TEST_EXISTS)) {
+        if (waitpid(*pid, NULL, WNOHANG) != 0) {
+            g_warning("Simulator exited before creating its AT port");
+            return FALSE;
+        }
+        if (waited >= BENCH_SIM_TIMEOUT) {
+            g_warning("Simulator didn't create its AT port");
+            kill(*pid, SIGTERM);
+            waitpid(*pid, NULL, 0);
+            return FALSE;
+        }
+        g_usleep(10000);
+        waited += 10;
+    }
+
+    return TRUE;
+}
+
+static void stop_simulator(GPid pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    g_spawn_close_pid(pid);
+}
+
+int main(int argc, char *argv[])
+{
+    g_autoptr(GOptionContext) opt_context = NULL;
+    g_autoptr(GError) err = NULL;
+    g_autofree gchar *tmpdir = NULL;
+    g_autofree gchar *port = NULL;
+    struct Bench bench;
+    gchar *config_file = NULL;
+    gint cycles = 3;
+    toml_table_t *toml_config;
+    char error[256];
+    GPid sim_pid;
+    FILE *f;
+    const GOptionEntry options[] = {
+        { "config", 'c', 0, G_OPTION_ARG_STRING, &config_file, "Config file to use.", NULL },
+        { "cycles", 'n', 0, G_OPTION_ARG_INT, &cycles, "Number of suspend/resume cycles.", "COUNT" },
+        { "mismatch", 'm', 0, G_OPTION_ARG_STRING, &bench.mismatch_cmd,
+          "Change a setting, then check the configure sequence changes it back.", "CMD" },
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+    };
+
+    memset(&bench, 0, sizeof(bench));
+    bench.manager.at_fd = -1;
+    bench.manager.suspend_delay_fd = -1;
+    bench.manager.suspend_block_fd = -1;
+
+    opt_context = g_option_context_new ("SIMULATOR [ARGS...] - Time AT sequences against the modem simulator");
+    g_option_context_add_main_entries (opt_context, options, NULL);
+    // Options following the simulator path are the simulator's
+    g_option_context_set_strict_posix (opt_context, TRUE);
+    if (!g_option_context_parse (opt_context, &argc, &argv, &err)) {
+        g_warning ("%s", err->message);
+        return 1;
+    }
+
+    if (argc < 2 || !config_file || cycles < 0) {
+        g_printerr("%s", g_option_context_get_help(opt_context, TRUE, NULL));
+        return 1;
+    }
+    bench.cycles = cycles;
+
+    f = fopen(config_file, "r");
+    if (!f)
+        g_error("unable to open config file %s", config_file);
+    toml_config = toml_parse_file(f, error, sizeof(error));
+    fclose(f);
+    if (!toml_config)
+        g_error("unable to parse config file: %s", error);
+
+    load_expect_keys(&bench, toml_table_in(toml_config, "at"));
+    if (bench.mismatch_cmd) {
+        bench.mismatch_key = get_set_key(bench.mismatch_cmd);
+        if (!bench.mismatch_key || !g_hash_table_contains(bench.expect_keys, bench.mismatch_key))
+            g_error("%s doesn't change a setting of the configure sequence", bench.mismatch_cmd);
+    }
+
+    tmpdir = g_dir_make_tmp("eg25-bench-XXXXXX", &err);
+    if (!tmpdir)
+        g_error("unable to create temporary directory: %s", err->message);
+    port = g_build_filename(tmpdir, "at", NULL);
+
+    if (!spawn_simulator(&argv[1], port, &sim_pid)) {
+        g_rmdir(tmpdir);
+        return 1;
+    }
+
+    bench.manager.loop = g_main_loop_new(NULL, FALSE);
+    bench.tx = g_string_new(NULL);
+    at_stubs_set_callback(bench_stub_event);
+
+    if (at_init_port(&bench.manager, toml_table_in(toml_config, "at"), port)) {
+        stop_simulator(sim_pid);
+        g_rmdir(tmpdir);
+        return 1;
+    }
+
+    // The simulator boots as soon as it starts, as the modem does on power-on
+    bench.manager.modem_state = EG25_STATE_POWERED;
+    bench_start_step(&bench, BENCH_BOOT);
+    bench.timeout_timer = g_timeout_add(BENCH_STEP_TIMEOUT, G_SOURCE_FUNC(bench_timeout), &bench);
+
+    g_main_loop_run(bench.manager.loop);
+
+    if (bench.timeout_timer)
+        g_source_remove(bench.timeout_timer);
+
+    at_destroy(&bench.manager);
+    stop_simulator(sim_pid);
+    g_rmdir(tmpdir);
+    g_string_free(bench.tx, TRUE);
+    g_hash_table_destroy(bench.expect_keys);
+    g_free(bench.mismatch_key);
+    toml_free(toml_config);
+
+    return bench.failed;
+}
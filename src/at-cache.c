@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "at-cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef EG25_STATEDIR
+#define EG25_STATEDIR "/var/lib/eg25-manager"
+#endif
+
+#define CACHE_FILE EG25_STATEDIR "/at-cache"
+
+#define GROUP_MODEM "modem"
+#define GROUP_VERIFIED "verified"
+
+/*
+ * The QCFG-like settings are stored in the modem's NV memory, so once we
+ * checked they match the configuration, there's no need to query them
+ * again as long as the modem firmware, the modem itself (identified by its
+ * IMEI) and the configured commands list stay the same.
+ *
+ * In `trust` mode, all verified settings are skipped. In `verify` mode, one
+ * of them (picked randomly) is still queried on each run, so drift is
+ * detected over time without paying for the full query sequence.
+ */
+enum AtCacheMode {
+    AT_CACHE_OFF = 0,
+    AT_CACHE_TRUST,
+    AT_CACHE_VERIFY,
+};
+
+static enum AtCacheMode cache_mode = AT_CACHE_OFF;
+static GKeyFile *cache = NULL;
+static gchar *cache_config_hash = NULL;
+static gboolean cache_valid = FALSE;
+static gboolean cache_dirty = FALSE;
+static gint cache_hits = 0;
+static gint cache_check = -1;
+
+/*
+ * Returns TRUE if the cache is enabled
+ */
+gboolean at_cache_init(toml_table_t *config, const char *config_hash)
+{
+    toml_datum_t mode = toml_string_in(config, "cache");
+
+    if (!mode.ok)
+        return FALSE;
+
+    if (strcmp(mode.u.s, "trust") == 0) {
+        cache_mode = AT_CACHE_TRUST;
+    } else if (strcmp(mode.u.s, "verify") == 0) {
+        cache_mode = AT_CACHE_VERIFY;
+    } else if (strcmp(mode.u.s, "off") != 0) {
+        g_warning("Unknown AT cache mode '%s', disabling cache", mode.u.s);
+    }
+    free(mode.u.s);
+
+    if (cache_mode == AT_CACHE_OFF)
+        return FALSE;
+
+    cache_config_hash = g_strdup(config_hash);
+    cache = g_key_file_new();
+    if (!g_key_file_load_from_file(cache, CACHE_FILE, G_KEY_FILE_NONE, NULL))
+        g_message("No usable AT cache found in " CACHE_FILE);
+
+    return TRUE;
+}
+
+void at_cache_destroy(void)
+{
+    if (cache) {
+        g_key_file_free(cache);
+        cache = NULL;
+    }
+    if (cache_config_hash) {
+        g_free(cache_config_hash);
+        cache_config_hash = NULL;
+    }
+}
+
+static void drop_verified(void)
+{
+    g_key_file_remove_group(cache, GROUP_VERIFIED, NULL);
+    cache_dirty = TRUE;
+}
+
+/*
+ * Must be called once both the firmware revision and the IMEI are known;
+ * the cache can't be used until then.
+ */
+void at_cache_set_modem(const char *firmware, const char *imei)
+{
+    g_autofree gchar *cached_firmware = NULL;
+    g_autofree gchar *cached_imei = NULL;
+    g_autofree gchar *cached_hash = NULL;
+    gsize count = 0;
+
+    if (!cache)
+        return;
+
+    cached_firmware = g_key_file_get_string(cache, GROUP_MODEM, "firmware", NULL);
+    cached_imei = g_key_file_get_string(cache, GROUP_MODEM, "imei", NULL);
+    cached_hash = g_key_file_get_string(cache, GROUP_MODEM, "config", NULL);
+
+    if (g_strcmp0(cached_firmware, firmware) != 0 ||
+        g_strcmp0(cached_imei, imei) != 0 ||
+        g_strcmp0(cached_hash, cache_config_hash) != 0) {
+        if (cached_hash)
+            g_message("Modem or configuration changed, discarding AT cache");
+        drop_verified();
+        g_key_file_set_string(cache, GROUP_MODEM, "firmware", firmware);
+        g_key_file_set_string(cache, GROUP_MODEM, "imei", imei);
+        g_key_file_set_string(cache, GROUP_MODEM, "config", cache_config_hash);
+    }
+
+    cache_valid = TRUE;
+    cache_hits = 0;
+    cache_check = -1;
+
+    if (cache_mode == AT_CACHE_VERIFY) {
+        g_strfreev(g_key_file_get_keys(cache, GROUP_VERIFIED, &count, NULL));
+        if (count > 0)
+            cache_check = g_random_int_range(0, (gint32)count);
+    }
+}
+
+void at_cache_save(void)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!cache || !cache_dirty)
+        return;
+
+    if (g_mkdir_with_parents(EG25_STATEDIR, 0755) < 0 ||
+        !g_key_file_save_to_file(cache, CACHE_FILE, &error)) {
+        g_warning("Unable to save AT cache: %s", error ? error->message : "can't create " EG25_STATEDIR);
+        return;
+    }
+
+    cache_dirty = FALSE;
+}
+
+gboolean at_cache_is_verified(const char *key, const char *expected)
+{
+    g_autofree gchar *value = NULL;
+
+    if (!cache || !cache_valid)
+        return FALSE;
+
+    value = g_key_file_get_string(cache, GROUP_VERIFIED, key, NULL);
+    if (g_strcmp0(value, expected) != 0)
+        return FALSE;
+
+    if (cache_hits++ == cache_check) {
+        g_message("Checking cached value of %s", key);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void at_cache_set_verified(const char *key, const char *expected)
+{
+    g_autofree gchar *value = NULL;
+
+    if (!cache || !cache_valid)
+        return;
+
+    value = g_key_file_get_string(cache, GROUP_VERIFIED, key, NULL);
+    if (g_strcmp0(value, expected) == 0)
+        return;
+
+    g_key_file_set_string(cache, GROUP_VERIFIED, key, expected);
+    cache_dirty = TRUE;
+}
+
+/*
+ * Called when a setting doesn't match the expected value: if we believed it
+ * did, the cache can't be trusted anymore
+ */
+void at_cache_mismatch(const char *key)
+{
+    if (!cache || !cache_valid)
+        return;
+
+    if (g_key_file_has_key(cache, GROUP_VERIFIED, key, NULL)) {
+        g_warning("Cached value of %s is outdated, discarding AT cache", key);
+        drop_verified();
+    }
+}
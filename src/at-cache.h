@@ -0,0 +1,19 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "manager.h"
+
+gboolean at_cache_init(toml_table_t *config, const char *config_hash);
+void at_cache_destroy(void);
+
+void at_cache_set_modem(const char *firmware, const char *imei);
+void at_cache_save(void);
+
+gboolean at_cache_is_verified(const char *key, const char *expected);
+void at_cache_set_verified(const char *key, const char *expected);
+void at_cache_mismatch(const char *key);
@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "at.h"
+#include "at-liveness.h"
+
+/*
+ * The modem firmware can hang while the USB device stays enumerated, which
+ * would otherwise only be noticed once ModemManager gives up on it. While
+ * the modem is up and the AT queue is idle, it is regularly sent a bare "AT":
+ * slowly as long as it answers, faster once it didn't, and the modem is reset
+ * after too many consecutive misses.
+ */
+
+// Defaults for the `liveness` setting, intervals are in seconds
+#define AT_LIVENESS_INTERVAL 60
+#define AT_LIVENESS_FAST_INTERVAL 5
+#define AT_LIVENESS_MISSES 3
+
+static guint liveness_interval = AT_LIVENESS_INTERVAL;
+static guint liveness_fast_interval = AT_LIVENESS_FAST_INTERVAL;
+static guint liveness_max_misses = AT_LIVENESS_MISSES;
+
+static guint liveness_timer = 0;
+static guint liveness_misses = 0;
+static gboolean liveness_failed = FALSE;
+static gboolean liveness_pending = FALSE;
+
+static gboolean liveness_tick(struct EG25Manager *manager);
+
+/*
+ * Only check the modem once it has been configured and while nothing else
+ * is talking to it; checks are also paused while suspending and resuming
+ */
+static gboolean liveness_active(struct EG25Manager *manager)
+{
+    switch (manager->modem_state) {
+    case EG25_STATE_CONFIGURED:
+    case EG25_STATE_REGISTERED:
+    case EG25_STATE_CONNECTED:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void liveness_schedule(struct EG25Manager *manager, guint interval)
+{
+    if (liveness_timer)
+        g_source_remove(liveness_timer);
+
+    // Healthy checks don't need to be accurate, let them be batched with other wakeups
+    if (interval == liveness_interval)
+        liveness_timer = g_timeout_add_seconds(interval, G_SOURCE_FUNC(liveness_tick), manager);
+    else
+        liveness_timer = g_timeout_add(interval * 1000, G_SOURCE_FUNC(liveness_tick), manager);
+}
+
+static void liveness_result(struct EG25Manager *manager,
+                            const char         *response,
+                            const char         *error,
+                            gpointer            user_data)
+{
+    gboolean failed = liveness_failed;
+
+    liveness_pending = FALSE;
+
+    // Dropped from the queue (modem reset, shutdown): nothing to learn here
+    if (g_strcmp0(error, "CANCELLED") == 0)
+        return;
+
+    if (g_strcmp0(error, "TIMEOUT") != 0) {
+        if (liveness_misses > 0)
+            g_message("Modem answering again after %u missed checks", liveness_misses);
+        liveness_misses = 0;
+        liveness_failed = error != NULL;
+    } else {
+        liveness_misses++;
+        liveness_failed = TRUE;
+        g_warning("Modem didn't answer liveness check (%u/%u)",
+                  liveness_misses, liveness_max_misses);
+
+        if (liveness_misses >= liveness_max_misses) {
+            g_critical("Modem not answering AT commands, resetting it");
+            liveness_misses = 0;
+            liveness_failed = FALSE;
+            modem_reset(manager);
+            return;
+        }
+    }
+
+    // Check again sooner than planned if something went wrong
+    if (liveness_failed && !failed)
+        liveness_schedule(manager, liveness_fast_interval);
+}
+
+static gboolean liveness_tick(struct EG25Manager *manager)
+{
+    liveness_timer = 0;
+
+    if (!liveness_active(manager)) {
+        liveness_misses = 0;
+        liveness_failed = FALSE;
+        liveness_schedule(manager, liveness_interval);
+        return G_SOURCE_REMOVE;
+    }
+
+    if (!liveness_pending && at_is_idle(manager)) {
+        if (at_request_async(manager, "", 0, liveness_result, NULL))
+            liveness_pending = TRUE;
+        liveness_schedule(manager, liveness_failed ? liveness_fast_interval : liveness_interval);
+    } else {
+        // Wait for the next gap in the AT traffic
+        liveness_schedule(manager, liveness_fast_interval);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+void at_liveness_init(struct EG25Manager *manager, toml_table_t *config)
+{
+    toml_table_t *table = toml_table_in(config, "liveness");
+    toml_datum_t value;
+
+    if (table) {
+        value = toml_int_in(table, "interval");
+        if (value.ok && value.u.i >= 0)
+            liveness_interval = (guint)MIN(value.u.i, G_MAXUINT / 1000);
+
+        value = toml_int_in(table, "fast_interval");
+        if (value.ok && value.u.i > 0)
+            liveness_fast_interval = (guint)MIN(value.u.i, G_MAXUINT / 1000);
+
+        value = toml_int_in(table, "misses");
+        if (value.ok && value.u.i > 0)
+            liveness_max_misses = (guint)value.u.i;
+    }
+
+    if (liveness_interval == 0) {
+        g_message("Modem liveness checks disabled");
+        return;
+    }
+
+    liveness_schedule(manager, liveness_interval);
+}
+
+void at_liveness_destroy(void)
+{
+    if (liveness_timer) {
+        g_source_remove(liveness_timer);
+        liveness_timer = 0;
+    }
+    liveness_misses = 0;
+    liveness_failed = FALSE;
+}
@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Replay an AT trace recorded by eg25-manager (see the `trace` option) through
+ * the AT commands processing code, acting as the modem on a pseudo-terminal:
+ *   - data received from the modem is fed back at the recorded pace (divided
+ *     by the `--speed` factor, or as fast as possible if 0)
+ *   - sequences and state changes are replayed as they were recorded
+ *   - commands sent by eg25-manager are compared to the recorded ones
+ *
+ * Data received after a command was sent is only replayed once that command
+ * has actually been sent, so that the replay stays in sync even when the AT
+ * code behaves differently with respect to timing.
+ */
+
+#define _GNU_SOURCE
+
+#include "at.h"
+#include "at-trace.h"
+#include "manager.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib-unix.h>
+
+// Give up waiting for a command after this many ms
+#define REPLAY_TX_TIMEOUT 30000
+
+struct Replay {
+    struct EG25Manager manager;
+    GArray *records;
+    guint current;
+    double speed;
+    int master_fd;
+    guint master_source;
+    guint timer;
+    GString *tx;
+    gint64 start_time;
+    guint64 trace_duration;
+    guint tx_matched;
+    guint tx_mismatched;
+};
+
+static const char *sequence_names[] = {
+    [AT_TRACE_CONFIGURE] = "configure",
+    [AT_TRACE_SUSPEND] = "suspend",
+    [AT_TRACE_RESUME] = "resume",
+    [AT_TRACE_RESET] = "reset",
+};
+
+static void replay_next(struct Replay *replay);
+
+static void replay_finish(struct Replay *replay)
+{
+    gint64 elapsed = g_get_monotonic_time() - replay->start_time;
+
+    g_message("Replay complete: %u records, %u/%u commands matched, final state %d",
+              replay->records->len, replay->tx_matched,
+              replay->tx_matched + replay->tx_mismatched,
+              replay->manager.modem_state);
+    g_message("Replay took %" G_GINT64_FORMAT " ms, trace lasted %" G_GUINT64_FORMAT " ms",
+              elapsed / 1000, replay->trace_duration / 1000);
+
+    g_main_loop_quit(replay->manager.loop);
+}
+
+/*
+ * Compare the data sent by the AT code to the expected command; returns FALSE
+ * if we need to wait for more data
+ */
+static gboolean replay_check_tx(struct Replay *replay, struct AtTraceRecord *record)
+{
+    if (replay->tx->len < record->len)
+        return FALSE;
+
+    if (memcmp(replay->tx->str, record->data, record->len) == 0) {
+        replay->tx_matched++;
+    } else {
+        g_warning("Replay: command mismatch at record %u: expected [%.*s], got [%.*s]",
+                  replay->current, (int)record->len - 2, record->data,
+                  (int)record->len - 2, replay->tx->str);
+        replay->tx_mismatched++;
+    }
+
+    g_string_erase(replay->tx, 0, record->len);
+
+    return TRUE;
+}
+
+static gboolean replay_tx_timeout(struct Replay *replay)
+{
+    struct AtTraceRecord *record = &g_array_index(replay->records, struct AtTraceRecord,
+                                                  replay->current);
+
+    g_warning("Replay: command [%.*s] never sent, skipping",
+              (int)record->len - 2, record->data);
+    replay->tx_mismatched++;
+    replay->timer = 0;
+    replay->current++;
+    replay_next(replay);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean replay_apply(struct Replay *replay)
+{
+    struct AtTraceRecord *record = &g_array_index(replay->records, struct AtTraceRecord,
+                                                  replay->current);
+
+    replay->timer = 0;
+
+    switch (record->type) {
+    case AT_TRACE_RX:
+        if (write(replay->master_fd, record->data, record->len) < (ssize_t)record->len)
+            g_warning("Replay: couldn't write %zu bytes to the AT port", record->len);
+        break;
+    case AT_TRACE_SEQUENCE:
+        g_message("Replay: %s sequence", sequence_names[record->data[0] % G_N_ELEMENTS(sequence_names)]);
+        switch (record->data[0]) {
+        case AT_TRACE_CONFIGURE:
+            at_sequence_configure(&replay->manager);
+            break;
+        case AT_TRACE_SUSPEND:
+            at_sequence_suspend(&replay->manager);
+            break;
+        case AT_TRACE_RESUME:
+            at_sequence_resume(&replay->manager);
+            break;
+        case AT_TRACE_RESET:
+            at_sequence_reset(&replay->manager);
+            break;
+        }
+        break;
+    case AT_TRACE_STATE:
+        replay->manager.modem_state = record->data[0];
+        break;
+    case AT_TRACE_GPIO:
+        g_message("Replay: GPIO %s sequence", record->data);
+        break;
+    case AT_TRACE_WAKE:
+        g_message("Replay: modem answered %" G_GUINT64_FORMAT " ms after being woken up",
+                  at_trace_varint(record) / 1000);
+        break;
+    default:
+        g_warning("Replay: unknown record type %d, skipping", record->type);
+        break;
+    }
+
+    replay->current++;
+    replay_next(replay);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void replay_next(struct Replay *replay)
+{
+    struct AtTraceRecord *record;
+    guint delay;
+
+    if (replay->current >= replay->records->len) {
+        replay_finish(replay);
+        return;
+    }
+
+    record = &g_array_index(replay->records, struct AtTraceRecord, replay->current);
+    if (record->type == AT_TRACE_TX) {
+        // Data may have been received before we got to this record
+        if (replay_check_tx(replay, record)) {
+            replay->current++;
+            replay_next(replay);
+        } else {
+            replay->timer = g_timeout_add(REPLAY_TX_TIMEOUT,
+                                          G_SOURCE_FUNC(replay_tx_timeout), replay);
+        }
+        return;
+    }
+
+    delay = replay->speed > 0 ? (guint)(record->delay / 1000 / replay->speed) : 0;
+    replay->timer = g_timeout_add(delay, G_SOURCE_FUNC(replay_apply), replay);
+}
+
+static gboolean replay_receive(gint fd, GIOCondition event, gpointer data)
+{
+    struct Replay *replay = data;
+    struct AtTraceRecord *record;
+    char buffer[256];
+    ssize_t ret;
+
+    while ((ret = read(fd, buffer, sizeof(buffer))) > 0)
+        g_string_append_len(replay->tx, buffer, ret);
+
+    if (replay->current >= replay->records->len)
+        return TRUE;
+
+    record = &g_array_index(replay->records, struct AtTraceRecord, replay->current);
+    if (record->type == AT_TRACE_TX && replay_check_tx(replay, record)) {
+        if (replay->timer)
+            g_source_remove(replay->timer);
+        replay->timer = 0;
+        replay->current++;
+        replay_next(replay);
+    }
+
+    return TRUE;
+}
+
+static int open_pty(gchar **port)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    if (fd < 0)
+        return -1;
+
+    if (grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    *port = g_strdup(ptsname(fd));
+
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    g_autoptr(GOptionContext) opt_context = NULL;
+    g_autoptr(GError) err = NULL;
+    g_autofree gchar *port = NULL;
+    struct Replay replay;
+    gchar *config_file = NULL;
+    toml_table_t *toml_config;
+    char error[256];
+    FILE *f;
+    const GOptionEntry options[] = {
+        { "config", 'c', 0, G_OPTION_ARG_STRING, &config_file, "Config file to use.", NULL },
+        { "speed", 's', 0, G_OPTION_ARG_DOUBLE, &replay.speed, "Replay speed factor (0 for no delay).", NULL },
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+    };
+
+    memset(&replay, 0, sizeof(replay));
+    replay.speed = 1.0;
+    replay.manager.at_fd = -1;
+    replay.manager.suspend_delay_fd = -1;
+    replay.manager.suspend_block_fd = -1;
+
+    opt_context = g_option_context_new ("TRACE - Replay an eg25-manager AT trace");
+    g_option_context_add_main_entries (opt_context, options, NULL);
+    if (!g_option_context_parse (opt_context, &argc, &argv, &err)) {
+        g_warning ("%s", err->message);
+        return 1;
+    }
+
+    if (argc != 2 || !config_file) {
+        g_printerr("%s", g_option_context_get_help(opt_context, TRUE, NULL));
+        return 1;
+    }
+
+    replay.records = at_trace_load(argv[1], &err);
+    if (!replay.records) {
+        g_warning("%s", err->message);
+        return 1;
+    }
+    if (replay.records->len == 0) {
+        g_warning("%s doesn't contain any record", argv[1]);
+        return 1;
+    }
+
+    for (guint i = 0; i < replay.records->len; i++)
+        replay.trace_duration += g_array_index(replay.records, struct AtTraceRecord, i).delay;
+
+    f = fopen(config_file, "r");
+    if (!f)
+        g_error("unable to open config file %s", config_file);
+    toml_config = toml_parse_file(f, error, sizeof(error));
+    fclose(f);
+    if (!toml_config)
+        g_error("unable to parse config file: %s", error);
+
+    replay.master_fd = open_pty(&port);
+    if (replay.master_fd < 0)
+        g_error("unable to create pseudo-terminal: %s", g_strerror(errno));
+
+    replay.manager.loop = g_main_loop_new(NULL, FALSE);
+    replay.tx = g_string_new(NULL);
+
+    if (at_init_port(&replay.manager, toml_table_in(toml_config, "at"), port))
+        return 1;
+
+    replay.master_source = g_unix_fd_add(replay.master_fd, G_IO_IN, replay_receive, &replay);
+    replay.start_time = g_get_monotonic_time();
+    replay_next(&replay);
+
+    g_main_loop_run(replay.manager.loop);
+
+    at_destroy(&replay.manager);
+    g_source_remove(replay.master_source);
+    close(replay.master_fd);
+    g_string_free(replay.tx, TRUE);
+    g_array_unref(replay.records);
+    toml_free(toml_config);
+
+    return replay.tx_mismatched > 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * The tools running the AT code on its own (eg25-replay and eg25-bench) don't
+ * have access to the GPIOs, ModemManager or logind: the functions from those
+ * modules are replaced here by their effect on the modem state, if any.
+ */
+
+#include "at-cache.h"
+#include "at-liveness.h"
+#include "at-stubs.h"
+#include "gpio.h"
+
+static AtStubCallback stub_callback = NULL;
+
+void at_stubs_set_callback(AtStubCallback callback)
+{
+    stub_callback = callback;
+}
+
+void modem_update_state(struct EG25Manager *manager, MMModemState state)
+{
+    g_message("Stub: ModemManager state %d", state);
+}
+
+void modem_started(struct EG25Manager *manager, const char *source)
+{
+    g_message("Stub: modem started (%s)", source);
+    manager->modem_state = EG25_STATE_STARTED;
+    if (stub_callback)
+        stub_callback(manager, AT_STUB_STARTED);
+}
+
+void modem_suspend_post(struct EG25Manager *manager)
+{
+    g_message("Stub: suspend sequence complete");
+    if (stub_callback)
+        stub_callback(manager, AT_STUB_SUSPENDED);
+}
+
+// The modem never sleeps, or its wake-ups are part of a replayed trace already
+gboolean gpio_modem_wake(struct EG25Manager *manager)
+{
+    return FALSE;
+}
+
+void gpio_modem_release(struct EG25Manager *manager) {}
+
+/*
+ * The persistent cache is disabled so the tools neither depend on nor alter
+ * the state of the system they run on
+ */
+gboolean at_cache_init(toml_table_t *config, const char *config_hash)
+{
+    return FALSE;
+}
+
+void at_cache_destroy(void) {}
+void at_cache_set_modem(const char *firmware, const char *imei) {}
+void at_cache_save(void) {}
+gboolean at_cache_is_verified(const char *key, const char *expected) { return FALSE; }
+void at_cache_set_verified(const char *key, const char *expected) {}
+void at_cache_mismatch(const char *key) {}
+
+// Liveness checks would send commands which aren't part of the sequences
+void at_liveness_init(struct EG25Manager *manager, toml_table_t *config) {}
+void at_liveness_destroy(void) {}
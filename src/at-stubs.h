@@ -0,0 +1,22 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "manager.h"
+
+/*
+ * Replacements for the functions of the other modules used by the AT code,
+ * so tools can run it on its own (see at-stubs.c)
+ */
+enum AtStubEvent {
+    AT_STUB_STARTED = 0,    // The modem sent RDY
+    AT_STUB_SUSPENDED,      // The suspend sequence completed
+};
+
+typedef void (*AtStubCallback)(struct EG25Manager *manager, enum AtStubEvent event);
+
+void at_stubs_set_callback(AtStubCallback callback);
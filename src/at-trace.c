@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "at-trace.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Trace files start with an 8 bytes header (magic + format version), followed
+ * by the records. Each record is made of:
+ *   - its type (1 byte)
+ *   - the time elapsed since the previous record, in microseconds (varint)
+ *   - the payload length (varint)
+ *   - the payload itself
+ * Varints are little-endian base 128, as the delays and lengths are usually
+ * small: most records only add 3 bytes to their payload.
+ */
+#define AT_TRACE_MAGIC "EG25TRC"
+#define AT_TRACE_VERSION 1
+#define AT_TRACE_HEADER_SIZE 8
+
+// Maximum size of an encoded varint (64 bits)
+#define AT_TRACE_VARINT_SIZE 10
+
+static FILE *trace_file = NULL;
+static gboolean trace_events = FALSE;
+static gint64 trace_last_time = 0;
+static enum EG25State trace_last_state = EG25_STATE_INIT;
+
+static gsize encode_varint(guint8 *buffer, guint64 value)
+{
+    gsize len = 0;
+
+    do {
+        buffer[len] = value & 0x7f;
+        value >>= 7;
+        if (value)
+            buffer[len] |= 0x80;
+        len++;
+    } while (value);
+
+    return len;
+}
+
+static gboolean decode_varint(const guint8 **data, const guint8 *end, guint64 *value)
+{
+    *value = 0;
+
+    for (guint shift = 0; *data < end && shift < 64; shift += 7) {
+        guint8 byte = *(*data)++;
+
+        *value |= (guint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void write_record(enum AtTraceType type, const void *data, gsize len)
+{
+    guint8 header[1 + 2 * AT_TRACE_VARINT_SIZE];
+    gint64 now = g_get_monotonic_time();
+    gsize header_len = 0;
+
+    header[header_len++] = type;
+    header_len += encode_varint(&header[header_len], now - trace_last_time);
+    header_len += encode_varint(&header[header_len], len);
+    trace_last_time = now;
+
+    if (fwrite(header, 1, header_len, trace_file) < header_len ||
+        fwrite(data, 1, len, trace_file) < len) {
+        g_warning("Unable to write AT trace, stopping: %s", g_strerror(errno));
+        at_trace_destroy();
+        return;
+    }
+
+    // Make sure the trace is usable even if we crash
+    fflush(trace_file);
+}
+
+/*
+ * State changes are made all over the place, so instead of tracking them
+ * individually, the current state is checked before writing each record
+ */
+static void record_state(struct EG25Manager *manager)
+{
+    guint8 state = manager->modem_state;
+
+    if (!trace_events || manager->modem_state == trace_last_state)
+        return;
+
+    trace_last_state = manager->modem_state;
+    write_record(AT_TRACE_STATE, &state, sizeof(state));
+}
+
+void at_trace_init(toml_table_t *config)
+{
+    toml_datum_t path = toml_string_in(config, "trace");
+    toml_datum_t events;
+
+    if (!path.ok)
+        return;
+
+    trace_file = fopen(path.u.s, "wb");
+    if (!trace_file) {
+        g_warning("Unable to open AT trace file %s: %s", path.u.s, g_strerror(errno));
+        free(path.u.s);
+        return;
+    }
+
+    events = toml_bool_in(config, "trace_events");
+    if (events.ok)
+        trace_events = events.u.b;
+
+    fwrite(AT_TRACE_MAGIC, 1, strlen(AT_TRACE_MAGIC), trace_file);
+    fputc(AT_TRACE_VERSION, trace_file);
+    trace_last_time = g_get_monotonic_time();
+    trace_last_state = EG25_STATE_INIT;
+
+    g_message("Recording AT traffic to %s", path.u.s);
+    free(path.u.s);
+}
+
+void at_trace_destroy(void)
+{
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+}
+
+void at_trace_record(struct EG25Manager *manager,
+                     enum AtTraceType    type,
+                     const void         *data,
+                     gsize               len)
+{
+    if (!trace_file)
+        return;
+
+    record_state(manager);
+    if (trace_file)
+        write_record(type, data, len);
+}
+
+void at_trace_sequence(struct EG25Manager *manager, enum AtTraceSequence sequence)
+{
+    guint8 value = sequence;
+
+    at_trace_record(manager, AT_TRACE_SEQUENCE, &value, sizeof(value));
+}
+
+void at_trace_gpio(struct EG25Manager *manager, const char *sequence)
+{
+    if (trace_events)
+        at_trace_record(manager, AT_TRACE_GPIO, sequence, strlen(sequence));
+}
+
+void at_trace_wake(struct EG25Manager *manager, guint64 latency)
+{
+    guint8 value[AT_TRACE_VARINT_SIZE];
+
+    if (trace_events)
+        at_trace_record(manager, AT_TRACE_WAKE, value, encode_varint(value, latency));
+}
+
+// Decode the payload of a record holding a single varint (0 if invalid)
+guint64 at_trace_varint(const struct AtTraceRecord *record)
+{
+    const guint8 *data = record->data;
+    guint64 value;
+
+    if (!decode_varint(&data, record->data + record->len, &value))
+        return 0;
+
+    return value;
+}
+
+static void clear_record(struct AtTraceRecord *record)
+{
+    g_free(record->data);
+}
+
+/*
+ * Load all records from a trace file; the returned array must be freed with
+ * g_array_unref()
+ */
+GArray *at_trace_load(const char *path, GError **error)
+{
+    g_autofree gchar *contents = NULL;
+    const guint8 *data, *end;
+    GArray *records;
+    gsize size;
+
+    if (!g_file_get_contents(path, &contents, &size, error))
+        return NULL;
+
+    if (size < AT_TRACE_HEADER_SIZE ||
+        memcmp(contents, AT_TRACE_MAGIC, strlen(AT_TRACE_MAGIC)) != 0 ||
+        contents[AT_TRACE_HEADER_SIZE - 1] != AT_TRACE_VERSION) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s isn't a valid AT trace file", path);
+        return NULL;
+    }
+
+    records = g_array_new(FALSE, TRUE, sizeof(struct AtTraceRecord));
+    g_array_set_clear_func(records, (GDestroyNotify)clear_record);
+
+    data = (const guint8 *)contents + AT_TRACE_HEADER_SIZE;
+    end = (const guint8 *)contents + size;
+    while (data < end) {
+        struct AtTraceRecord record = { 0 };
+        guint64 len;
+
+        record.type = *data++;
+        if (!decode_varint(&data, end, &record.delay) ||
+            !decode_varint(&data, end, &len) ||
+            len > (guint64)(end - data)) {
+            // The daemon was likely killed while writing the last record
+            g_warning("Truncated record at the end of %s, ignoring", path);
+            break;
+        }
+
+        record.len = len;
+        record.data = g_malloc(len + 1);
+        memcpy(record.data, data, len);
+        record.data[len] = '\0';
+        data += len;
+
+        g_array_append_val(records, record);
+    }
+
+    return records;
+}
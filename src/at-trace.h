@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#pragma once
+
+#include "manager.h"
+
+enum AtTraceType {
+    AT_TRACE_TX = 1,    // Bytes written to the modem
+    AT_TRACE_RX,        // Bytes read from the modem
+    AT_TRACE_SEQUENCE,  // AT sequence queued, 1 byte (enum AtTraceSequence)
+    AT_TRACE_STATE,     // New modem state, 1 byte (enum EG25State)
+    AT_TRACE_GPIO,      // GPIO sequence executed, name of the sequence
+    AT_TRACE_WAKE,      // Modem answered after a DTR wake-up, latency in microseconds (varint)
+};
+
+enum AtTraceSequence {
+    AT_TRACE_CONFIGURE = 0,
+    AT_TRACE_SUSPEND,
+    AT_TRACE_RESUME,
+    AT_TRACE_RESET,
+};
+
+/*
+ * Record as loaded from a trace file; `delay` is the time elapsed since the
+ * previous record, in microseconds
+ */
+struct AtTraceRecord {
+    enum AtTraceType type;
+    guint64 delay;
+    guint8 *data;
+    gsize len;
+};
+
+void at_trace_init(toml_table_t *config);
+void at_trace_destroy(void);
+
+void at_trace_record(struct EG25Manager *manager,
+                     enum AtTraceType    type,
+                     const void         *data,
+                     gsize               len);
+void at_trace_sequence(struct EG25Manager *manager, enum AtTraceSequence sequence);
+void at_trace_gpio(struct EG25Manager *manager, const char *sequence);
+void at_trace_wake(struct EG25Manager *manager, guint64 latency);
+guint64 at_trace_varint(const struct AtTraceRecord *record);
+
+GArray *at_trace_load(const char *path, GError **error);
@@ -5,8 +5,12 @@
  */
 
 #include "at.h"
-#include "suspend.h"
+#include "at-cache.h"
+#include "at-liveness.h"
+#include "at-trace.h"
+#include "gpio.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -16,12 +20,115 @@
 
 #include <glib-unix.h>
 
+/*
+ * Full command line, including the "AT" prefix and the trailing CRLF
+ */
+struct AtCommandLine {
+    char *data;
+    gsize len;
+};
+
+/*
+ * How a failing command is retried: after the n-th failure, the command is
+ * sent again after `delay * backoff^(n-1)` ms, plus up to `jitter` ms
+ */
+struct AtRetryPolicy {
+    int retries;
+    int delay;
+    double backoff;
+    int jitter;
+};
+
+/*
+ * Single field of an information response (e.g. `+QCFG: "ims",1` has fields
+ * `"ims"` and `1`) or of an `expect` value, stored without its quotes
+ */
+struct AtField {
+    gchar *value;
+    gboolean quoted;
+};
+
+/*
+ * Commands as parsed from the configuration file: those are never modified
+ * once loaded, the command queue only references them. The command lines
+ * for querying the current state and for setting the parameter (to either
+ * `value` or `expected`) are built once when loading the configuration.
+ */
 struct AtCommand {
+    gboolean basic;
     char *cmd;
     char *subcmd;
     char *value;
     char *expected;
+    GArray *expected_fields;
+    struct AtCommandLine query;
+    struct AtCommandLine set_value;
+    struct AtCommandLine set_expected;
+    int timeout;
+    struct AtRetryPolicy retry;
+    GStrv if_firmware;
+    GStrv unless_firmware;
+    gboolean batch;
+    void (*callback)(struct EG25Manager *manager, const char *response);
+    // Called before sending a failed command again, and when giving up on it
+    void (*retry_callback)(struct EG25Manager *manager, int retries);
+    void (*abort_callback)(struct EG25Manager *manager);
+};
+
+/*
+ * Request queued by at_request_async(): its command is built for this
+ * request only, and freed along with it once the callback has been called
+ */
+struct AtRequest {
+    struct AtCommand command;
+    struct EG25Manager *manager;
+    AtRequestCallback callback;
+    gpointer user_data;
+};
+
+/*
+ * State of a queued command: `value` and `expected` initially point to the
+ * command's own strings, and are swapped when a setting needs to be changed
+ */
+struct AtQueueEntry {
+    const struct AtCommand *command;
+    const char *value;
+    const char *expected;
     int retries;
+    gint64 sent_time;
+    gint64 written_time;
+    gboolean batch;
+    gboolean cache_checked;
+    struct AtRequest *request;
+};
+
+// Default time (in ms) we wait for the modem to answer a command
+#define AT_DEFAULT_TIMEOUT 5000
+
+// Maximum length of a command line, including the trailing CRLF
+#define AT_COMMAND_MAX_LENGTH 256
+
+// Upper bound for the delay between two attempts, in ms
+#define AT_MAX_RETRY_DELAY 30000
+
+static const struct AtRetryPolicy default_retry_policy = {
+    .retries = 3,
+    .delay = 500,
+    .backoff = 1.0,
+    .jitter = 0,
+};
+
+/*
+ * +CME ERROR codes for which retrying is pointless: those are reported right
+ * away and the command is aborted
+ */
+static const int permanent_cme_errors[] = {
+    3,   // Operation not allowed
+    4,   // Operation not supported
+    10,  // SIM not inserted
+    50,  // Incorrect parameters
+    504, // GNSS session is ongoing
+    505, // GNSS session is not active
 };
 
 static GArray *configure_commands = NULL;
@@ -29,7 +136,238 @@ static GArray *suspend_commands = NULL;
 static GArray *resume_commands = NULL;
 static GArray *reset_commands = NULL;
 
-static int configure_serial(const char *tty)
+// Internal command used to identify the modem in the cache
+static struct AtCommand imei_command;
+/*
+ * Internal command used to query the firmware revision when some commands
+ * depend on it but the configure sequence doesn't include AT+QGMR
+ */
+static struct AtCommand firmware_command;
+static gboolean firmware_query_needed = FALSE;
+
+/*
+ * Pending commands are kept in rings allocated once at startup, so queuing
+ * and running a sequence doesn't need any memory allocation. `active` is set
+ * while a sequence is queued and cleared once it completes or is cancelled.
+ */
+struct AtQueue {
+    struct AtQueueEntry *entries;
+    guint size;
+    guint head;
+    guint len;
+    gboolean active;
+};
+
+/*
+ * Each sequence has its own queue, so a higher-priority sequence (e.g.
+ * suspend) doesn't have to wait for a lower-priority one (e.g. configure) to
+ * complete: the next command is always taken from the highest-priority
+ * non-empty queue, so preemption happens at command boundaries.
+ */
+enum AtPriority {
+    AT_PRIORITY_RESET = 0,
+    AT_PRIORITY_SUSPEND,
+    AT_PRIORITY_RESUME,
+    AT_PRIORITY_CONFIGURE,
+    AT_PRIORITY_ADHOC,
+    AT_PRIORITY_COUNT
+};
+
+// Room for ad-hoc commands, which aren't part of any configured sequence
+#define AT_ADHOC_QUEUE_SIZE 16
+
+/*
+ * Requests dropped from their queue: their callbacks are called from an idle
+ * source, as the queues can't be modified while they're being cancelled
+ */
+static GSList *cancelled_requests = NULL;
+static guint cancelled_requests_source = 0;
+
+static struct AtQueue at_queues[AT_PRIORITY_COUNT];
+
+// Queue from which the last command line was sent
+static struct AtQueue *at_current = NULL;
+
+/*
+ * When batching is enabled, consecutive configure commands are chained into
+ * a single command line; `at_batch_size` is the number of commands (starting
+ * from the head of the queue) sent in the last command line.
+ */
+static gboolean batch_enabled = FALSE;
+static guint at_batch_size = 0;
+
+static gboolean cache_enabled = FALSE;
+
+/*
+ * Command disabling echo and/or switching to numeric result codes, sent at
+ * the start of each configure sequence as those settings are lost whenever
+ * the modem reboots. `rx_numeric` is set once numeric result codes are
+ * requested, and cleared when the modem reboots.
+ */
+static struct AtCommand session_command;
+static gboolean session_numeric = FALSE;
+static gboolean rx_numeric = FALSE;
+
+/*
+ * UART rate negotiation, done at the start of the configure sequence when
+ * `baudrate` is set: a plain "AT" probes the modem's current rate (trying the
+ * target and default rates in turn), then AT+IPR switches both ends to the
+ * target rate, which is verified with a second probe. If the modem stops
+ * responding, we go back to the default rate and stop trying until the next
+ * configure sequence.
+ */
+static struct AtCommand probe_command;
+static struct AtCommand ipr_command;
+static gboolean baud_verified = FALSE;
+static gboolean baud_failed = FALSE;
+
+// Time (in ms) we wait for the modem to answer a probe
+#define AT_PROBE_TIMEOUT 500
+
+/*
+ * Incoming bytes are stored in a ring buffer, from which complete lines are
+ * extracted as soon as a line terminator is received. Lines are then
+ * accumulated until a final result code is found, so a response can span
+ * any number of G_IO_IN events and is never truncated.
+ */
+#define AT_RX_BUFFER_SIZE 4096
+
+static struct {
+    char data[AT_RX_BUFFER_SIZE];
+    gsize head;
+    gsize len;
+} rx_ring;
+
+static GString *rx_line = NULL;
+static GString *rx_response = NULL;
+
+/*
+ * Outgoing bytes are queued here and written as fast as the port accepts
+ * them, the remainder of a partial write being sent from a G_IO_OUT watch.
+ * As only one command line is in flight at any time, a command is held back
+ * (until it times out) rather than queued while the previous one is still
+ * being written.
+ */
+#define AT_TX_BUFFER_SIZE 1024
+
+static struct {
+    char data[AT_TX_BUFFER_SIZE];
+    gsize head;
+    gsize len;
+} tx_buffer;
+
+/*
+ * The modem may be asleep when writing to the UART (see gpio_modem_wake()):
+ * once woken up, it's given `wake_delay` ms before the command is actually
+ * written, and allowed to sleep again after `wake_idle` ms without traffic.
+ * `wake_time` is used to measure how long it takes to answer after waking up,
+ * see at_wake_latency().
+ */
+#define AT_WAKE_DELAY 20
+#define AT_WAKE_IDLE 1000
+
+static guint wake_delay = AT_WAKE_DELAY;
+static guint wake_idle = AT_WAKE_IDLE;
+static guint wake_timer = 0;
+static guint wake_release_timer = 0;
+static gboolean wake_held = FALSE;
+static gint64 wake_time = 0;
+static guint wake_latency_last = 0;
+static guint64 wake_latency_total = 0;
+static guint wake_latency_count = 0;
+
+struct AtUrcHandler {
+    char *prefix;
+    AtUrcCallback callback;
+    gpointer user_data;
+};
+
+static GArray *urc_handlers = NULL;
+
+/*
+ * Prefixes of the unsolicited result codes the modem is known to emit, so
+ * they can be told apart from solicited output even if nobody subscribed
+ */
+static const char *const known_urcs[] = {
+    "RDY",
+    "RING",
+    "NO CARRIER",
+    "POWERED DOWN",
+    "+CDS:",
+    "+CEREG:",
+    "+CGREG:",
+    "+CLIP:",
+    "+CMT:",
+    "+CMTI:",
+    "+CPIN:",
+    "+CREG:",
+    "+CRING:",
+    "+CTZE:",
+    "+CTZV:",
+    "+CUSD:",
+    "+QGPSURC:",
+    "+QIND:",
+    "+QNITZ:",
+    "+QUSIM:",
+};
+
+/*
+ * Port used to talk to the modem, along with its health: a USB port is
+ * considered failed after a few consecutive timeouts or if it disappears
+ */
+struct AtPort {
+    gchar *path;
+    gboolean usb;
+    int fd;
+    guint timeouts;
+    gint64 failed_time;
+};
+
+// Consecutive timeouts after which a USB port is considered failed
+#define AT_PORT_MAX_TIMEOUTS 2
+// Time (in s) after which a failed USB port can be used again
+#define AT_PORT_FAILED_DELAY 60
+
+static GArray *at_ports = NULL;
+static struct AtPort *at_port = NULL;
+
+// Rate the modem's UART uses after booting
+#define AT_DEFAULT_BAUDRATE 115200
+
+static const struct {
+    guint rate;
+    speed_t speed;
+} baudrates[] = {
+    { 9600, B9600 },
+    { 19200, B19200 },
+    { 38400, B38400 },
+    { 57600, B57600 },
+    { 115200, B115200 },
+    { 230400, B230400 },
+    { 460800, B460800 },
+    { 921600, B921600 },
+};
+
+/*
+ * `uart_baudrate` is the rate currently used on our side of the UART, and
+ * `target_baudrate` the one we try to negotiate with AT+IPR
+ */
+static guint uart_baudrate = AT_DEFAULT_BAUDRATE;
+static guint target_baudrate = AT_DEFAULT_BAUDRATE;
+// Set when the rate must be switched once pending output has been written
+static gboolean uart_rate_pending = FALSE;
+
+static speed_t baudrate_to_speed(guint rate)
+{
+    for (guint i = 0; i < G_N_ELEMENTS(baudrates); i++) {
+        if (baudrates[i].rate == rate)
+            return baudrates[i].speed;
+    }
+
+    return B0;
+}
+
+static int configure_serial(const char *tty, guint rate)
 {
     struct termios ttycfg;
     int fd;
@@ -45,190 +383,1669 @@ static int configure_serial(const char *tty)
         ttycfg.c_cc[VMIN] = 1;
         ttycfg.c_cc[VTIME] = 0;
 
-        cfsetspeed(&ttycfg, B115200);
-        tcsetattr(fd, TCSANOW, &ttycfg);
+        cfsetspeed(&ttycfg, baudrate_to_speed(rate));
+        tcsetattr(fd, TCSANOW, &ttycfg);
+    }
+
+    return fd;
+}
+
+static gboolean at_command_timeout(struct EG25Manager *manager);
+static gboolean modem_response(gint fd, GIOCondition event, gpointer data);
+static void tx_reset(struct EG25Manager *manager);
+
+/*
+ * AT ports: the USB ones (if configured) are preferred as long as they are
+ * present and healthy, the UART (always the last port) is used otherwise,
+ * e.g. while the modem is booting or resuming. Switching only happens
+ * between two commands.
+ */
+static gboolean port_open(struct AtPort *port)
+{
+    if (port->fd >= 0)
+        return TRUE;
+
+    port->fd = configure_serial(port->path, port->usb ? AT_DEFAULT_BAUDRATE : uart_baudrate);
+    if (port->fd < 0)
+        return FALSE;
+
+    return TRUE;
+}
+
+static void port_close(struct EG25Manager *manager, struct AtPort *port)
+{
+    if (port == at_port) {
+        tx_reset(manager);
+        if (manager->at_source)
+            g_source_remove(manager->at_source);
+        manager->at_source = 0;
+        manager->at_fd = -1;
+        at_port = NULL;
+    }
+
+    if (port->fd >= 0) {
+        close(port->fd);
+        port->fd = -1;
+    }
+}
+
+static void port_failed(struct EG25Manager *manager, struct AtPort *port)
+{
+    g_warning("AT port %s failed, falling back to the next one", port->path);
+    port->failed_time = g_get_monotonic_time();
+    port->timeouts = 0;
+    port_close(manager, port);
+}
+
+static gboolean port_available(struct AtPort *port)
+{
+    if (port->failed_time &&
+        g_get_monotonic_time() - port->failed_time < AT_PORT_FAILED_DELAY * G_USEC_PER_SEC)
+        return FALSE;
+
+    // USB ports only exist while the modem is enumerated
+    return access(port->path, R_OK | W_OK) == 0 && port_open(port);
+}
+
+static void port_activate(struct EG25Manager *manager, struct AtPort *port)
+{
+    if (at_port) {
+        tx_reset(manager);
+        g_source_remove(manager->at_source);
+        manager->at_source = 0;
+        // The UART is kept open as we need it as a fallback
+        if (at_port->usb)
+            port_close(manager, at_port);
+        at_port = NULL;
+    }
+
+    // Data received while the port wasn't active is outdated
+    tcflush(port->fd, TCIFLUSH);
+    rx_ring.head = 0;
+    rx_ring.len = 0;
+    if (rx_line)
+        g_string_truncate(rx_line, 0);
+
+    at_port = port;
+    manager->at_fd = port->fd;
+    manager->at_source = g_unix_fd_add(port->fd, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                       modem_response, manager);
+
+    g_message("Using AT port %s", port->path);
+}
+
+static void apply_uart_baudrate(void)
+{
+    struct AtPort *uart = &g_array_index(at_ports, struct AtPort, at_ports->len - 1);
+    struct termios ttycfg;
+
+    uart_rate_pending = FALSE;
+    if (uart->fd < 0)
+        return;
+
+    /*
+     * No need to drain the output: we get here once the modem answered the
+     * last command line or it timed out, long after it left the kernel queue
+     */
+    tcgetattr(uart->fd, &ttycfg);
+    cfsetspeed(&ttycfg, baudrate_to_speed(uart_baudrate));
+    tcsetattr(uart->fd, TCSANOW, &ttycfg);
+    // Anything received during the switch is garbage
+    tcflush(uart->fd, TCIFLUSH);
+
+    g_message("UART rate set to %u bauds", uart_baudrate);
+}
+
+/*
+ * Change the rate used on our side of the UART; if a command line is still
+ * being written, the switch is deferred until tx_flush() is done with it so
+ * it's sent at the previous rate without blocking the main loop
+ */
+static void set_uart_baudrate(guint rate)
+{
+    struct AtPort *uart = &g_array_index(at_ports, struct AtPort, at_ports->len - 1);
+
+    uart_baudrate = rate;
+    if (uart == at_port && tx_buffer.len > 0)
+        uart_rate_pending = TRUE;
+    else
+        apply_uart_baudrate();
+}
+
+/*
+ * Select the preferred port available; returns FALSE if none can be used
+ */
+static gboolean transport_select(struct EG25Manager *manager)
+{
+    for (guint i = 0; i < at_ports->len; i++) {
+        struct AtPort *port = &g_array_index(at_ports, struct AtPort, i);
+
+        if (port == at_port && port->fd >= 0)
+            return TRUE;
+
+        if (port->usb ? port_available(port) : port_open(port)) {
+            port_activate(manager, port);
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/*
+ * Build the command line for `at_cmd` with the given value, or the query (or
+ * plain execution, if there's no `expected` value) command if `value` is NULL
+ */
+static void build_command_line(struct AtCommandLine *line,
+                               const struct AtCommand *at_cmd,
+                               const char *value)
+{
+    // Basic commands have no "+" prefix and take their value right away (e.g. "ATE0")
+    if (at_cmd->basic && value)
+        line->data = g_strdup_printf("AT%s%s\r\n", at_cmd->cmd, value);
+    else if (at_cmd->basic && at_cmd->expected)
+        line->data = g_strdup_printf("AT%s?\r\n", at_cmd->cmd);
+    else if (at_cmd->basic)
+        line->data = g_strdup_printf("AT%s\r\n", at_cmd->cmd);
+    else if (at_cmd->subcmd == NULL && value == NULL && at_cmd->expected == NULL)
+        line->data = g_strdup_printf("AT+%s\r\n", at_cmd->cmd);
+    else if (at_cmd->subcmd == NULL && value == NULL)
+        line->data = g_strdup_printf("AT+%s?\r\n", at_cmd->cmd);
+    else if (at_cmd->subcmd == NULL && value)
+        line->data = g_strdup_printf("AT+%s=%s\r\n", at_cmd->cmd, value);
+    else if (at_cmd->subcmd && value == NULL)
+        line->data = g_strdup_printf("AT+%s=\"%s\"\r\n", at_cmd->cmd, at_cmd->subcmd);
+    else
+        line->data = g_strdup_printf("AT+%s=\"%s\",%s\r\n", at_cmd->cmd, at_cmd->subcmd, value);
+
+    line->len = strlen(line->data);
+    if (line->len > AT_COMMAND_MAX_LENGTH)
+        g_error("AT command line too long (%zu > %d bytes): %s",
+                line->len, AT_COMMAND_MAX_LENGTH, line->data);
+}
+
+static void build_command_lines(struct AtCommand *at_cmd)
+{
+    build_command_line(&at_cmd->query, at_cmd, NULL);
+    if (at_cmd->value)
+        build_command_line(&at_cmd->set_value, at_cmd, at_cmd->value);
+    if (at_cmd->expected)
+        build_command_line(&at_cmd->set_expected, at_cmd, at_cmd->expected);
+}
+
+static const struct AtCommandLine *get_command_line(struct AtQueueEntry *entry)
+{
+    if (!entry->value)
+        return &entry->command->query;
+    if (entry->value == entry->command->expected)
+        return &entry->command->set_expected;
+
+    return &entry->command->set_value;
+}
+
+static struct AtQueueEntry *queue_peek(struct AtQueue *queue, guint index)
+{
+    if (!queue || index >= queue->len)
+        return NULL;
+
+    return &queue->entries[(queue->head + index) % queue->size];
+}
+
+static gboolean queue_push(struct AtQueue *queue, const struct AtCommand *at_cmd)
+{
+    struct AtQueueEntry *entry;
+
+    if (queue->len == queue->size) {
+        g_critical("AT command queue is full, dropping command %s", at_cmd->cmd);
+        return FALSE;
+    }
+
+    entry = &queue->entries[(queue->head + queue->len) % queue->size];
+    queue->len++;
+    queue->active = TRUE;
+
+    entry->command = at_cmd;
+    entry->value = at_cmd->value;
+    entry->expected = at_cmd->expected;
+    entry->retries = 0;
+    entry->sent_time = 0;
+    entry->batch = at_cmd->batch;
+    entry->cache_checked = FALSE;
+    entry->request = NULL;
+
+    return TRUE;
+}
+
+static void request_finish(struct AtRequest *request, const char *response, const char *error)
+{
+    if (request->callback)
+        request->callback(request->manager, response, error, request->user_data);
+
+    g_free(request->command.cmd);
+    g_free(request->command.query.data);
+    g_free(request);
+}
+
+static gboolean request_flush_cancelled(gpointer data)
+{
+    GSList *requests = g_slist_reverse(cancelled_requests);
+
+    cancelled_requests = NULL;
+    cancelled_requests_source = 0;
+
+    for (GSList *l = requests; l; l = l->next)
+        request_finish(l->data, NULL, "CANCELLED");
+    g_slist_free(requests);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void queue_remove(struct AtQueue *queue, guint index)
+{
+    if (index >= queue->len)
+        return;
+
+    if (index == 0) {
+        queue->head = (queue->head + 1) % queue->size;
+    } else {
+        // Close the gap, the queue is short enough for this to be cheap
+        for (guint i = index; i < queue->len - 1; i++)
+            *queue_peek(queue, i) = *queue_peek(queue, i + 1);
+    }
+
+    queue->len--;
+}
+
+/*
+ * Cancel the sequence in `queue`, keeping only its first `keep` commands
+ * (those being processed by the modem, if any)
+ */
+static void queue_cancel(struct AtQueue *queue, guint keep)
+{
+    if (queue->len > keep)
+        g_message("Cancelling %u pending AT commands", queue->len - keep);
+
+    for (guint i = keep; i < queue->len; i++) {
+        struct AtQueueEntry *entry = queue_peek(queue, i);
+
+        if (entry->request)
+            cancelled_requests = g_slist_prepend(cancelled_requests, entry->request);
+    }
+    if (cancelled_requests && !cancelled_requests_source)
+        cancelled_requests_source = g_idle_add(request_flush_cancelled, NULL);
+
+    queue->len = MIN(queue->len, keep);
+    queue->active = FALSE;
+}
+
+static gboolean at_command_pending(struct EG25Manager *manager)
+{
+    return manager->at_timeout_timer != 0 || manager->at_retry_timer != 0;
+}
+
+/*
+ * Commands which are still being processed by the modem can't be cancelled
+ */
+static void cancel_sequence(struct EG25Manager *manager, enum AtPriority priority)
+{
+    struct AtQueue *queue = &at_queues[priority];
+    guint keep = 0;
+
+    if (queue == at_current && at_command_pending(manager))
+        keep = at_batch_size;
+
+    queue_cancel(queue, keep);
+}
+
+/*
+ * Sequences can become obsolete when the modem state changes: there's no
+ * point in resuming the modem if we're about to suspend again, and nothing
+ * but the reset sequence is useful while the modem is being reset.
+ */
+static gboolean is_obsolete(struct EG25Manager *manager, enum AtPriority priority)
+{
+    switch (priority) {
+    case AT_PRIORITY_RESUME:
+        return manager->modem_state == EG25_STATE_SUSPENDING ||
+               manager->modem_state == EG25_STATE_RESETTING;
+    case AT_PRIORITY_CONFIGURE:
+    case AT_PRIORITY_ADHOC:
+        return manager->modem_state == EG25_STATE_RESETTING;
+    default:
+        return FALSE;
+    }
+}
+
+// Lower-priority sequences are kept on hold while the system is suspending
+static gboolean is_paused(struct EG25Manager *manager, enum AtPriority priority)
+{
+    return manager->modem_state == EG25_STATE_SUSPENDING &&
+           priority > AT_PRIORITY_SUSPEND;
+}
+
+static void sequence_done(struct EG25Manager *manager, enum AtPriority priority)
+{
+    switch (priority) {
+    case AT_PRIORITY_CONFIGURE:
+        at_cache_save();
+        if (manager->modem_state >= EG25_STATE_CONFIGURED)
+            break;
+
+        if (manager->modem_iface == MODEM_IFACE_MODEMMANAGER) {
+            MMModemState modem_state = mm_modem_get_state(manager->mm_modem);
+
+            if (manager->mm_modem && modem_state >= MM_MODEM_STATE_REGISTERED)
+                modem_update_state(manager, modem_state);
+            else
+                manager->modem_state = EG25_STATE_CONFIGURED;
+        } else {
+            manager->modem_state = EG25_STATE_CONFIGURED;
+        }
+        break;
+    case AT_PRIORITY_SUSPEND:
+        if (manager->modem_state == EG25_STATE_SUSPENDING)
+            modem_suspend_post(manager);
+        break;
+    case AT_PRIORITY_RESET:
+        if (manager->modem_state == EG25_STATE_RESETTING)
+            manager->modem_state = EG25_STATE_POWERED;
+        // The modem will boot at its default rate, don't miss its RDY
+        if (uart_baudrate != AT_DEFAULT_BAUDRATE) {
+            set_uart_baudrate(AT_DEFAULT_BAUDRATE);
+            baud_verified = FALSE;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static gchar *cache_key(struct AtQueueEntry *entry)
+{
+    if (entry->command->subcmd)
+        return g_strdup_printf("%s/%s", entry->command->cmd, entry->command->subcmd);
+
+    return g_strdup(entry->command->cmd);
+}
+
+/*
+ * Compare version strings, handling sequences of digits as numbers so that
+ * e.g. "01.010" > "01.009" and "R07" < "R10"
+ */
+static int compare_versions(const char *a, const char *b)
+{
+    while (*a && *b) {
+        if (g_ascii_isdigit(*a) && g_ascii_isdigit(*b)) {
+            gsize len_a, len_b;
+            int ret;
+
+            while (*a == '0' && g_ascii_isdigit(a[1]))
+                a++;
+            while (*b == '0' && g_ascii_isdigit(b[1]))
+                b++;
+
+            len_a = strspn(a, "0123456789");
+            len_b = strspn(b, "0123456789");
+            if (len_a != len_b)
+                return len_a < len_b ? -1 : 1;
+
+            ret = strncmp(a, b, len_a);
+            if (ret)
+                return ret;
+
+            a += len_a;
+            b += len_b;
+        } else {
+            if (*a != *b)
+                return *a < *b ? -1 : 1;
+            a++;
+            b++;
+        }
+    }
+
+    return *a ? 1 : (*b ? -1 : 0);
+}
+
+/*
+ * A condition is a space-separated list of glob patterns (e.g. "*_01.003.*")
+ * and/or version comparisons (e.g. ">=EG25GGBR07A08M2G_01.002.01.002"), which
+ * must all match the firmware revision
+ */
+static gboolean firmware_condition_matches(const char *firmware, const char *condition)
+{
+    g_auto(GStrv) tokens = g_strsplit(condition, " ", -1);
+
+    for (guint i = 0; tokens[i]; i++) {
+        const char *token = tokens[i];
+        int cmp;
+
+        if (!token[0])
+            continue;
+
+        if (g_str_has_prefix(token, ">=")) {
+            cmp = compare_versions(firmware, token + 2);
+            if (cmp < 0)
+                return FALSE;
+        } else if (g_str_has_prefix(token, "<=")) {
+            cmp = compare_versions(firmware, token + 2);
+            if (cmp > 0)
+                return FALSE;
+        } else if (token[0] == '>') {
+            if (compare_versions(firmware, token + 1) <= 0)
+                return FALSE;
+        } else if (token[0] == '<') {
+            if (compare_versions(firmware, token + 1) >= 0)
+                return FALSE;
+        } else if (token[0] == '=') {
+            if (compare_versions(firmware, token + 1) != 0)
+                return FALSE;
+        } else if (!g_pattern_match_simple(token, firmware)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+// Returns TRUE if any of the conditions matches
+static gboolean firmware_matches(const char *firmware, GStrv conditions)
+{
+    for (guint i = 0; conditions[i]; i++) {
+        if (firmware_condition_matches(firmware, conditions[i]))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * Check the command's `if_firmware` and `unless_firmware` conditions; if the
+ * firmware revision isn't known (yet), the command is always sent
+ */
+static gboolean is_supported(struct EG25Manager *manager, struct AtQueueEntry *entry)
+{
+    const struct AtCommand *cmd = entry->command;
+
+    if (!manager->modem_firmware)
+        return TRUE;
+
+    if (cmd->if_firmware && !firmware_matches(manager->modem_firmware, cmd->if_firmware))
+        return FALSE;
+    if (cmd->unless_firmware && firmware_matches(manager->modem_firmware, cmd->unless_firmware))
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Each query is looked up only once, so in `verify` mode the command picked
+ * for checking is still sent when retried
+ */
+static gboolean is_cached(struct AtQueueEntry *entry)
+{
+    g_autofree gchar *key = NULL;
+
+    if (!entry->expected || entry->cache_checked)
+        return FALSE;
+
+    entry->cache_checked = TRUE;
+    key = cache_key(entry);
+
+    return at_cache_is_verified(key, entry->expected);
+}
+
+/*
+ * Rate negotiation commands are only needed on the UART, and only until the
+ * target rate is known to work (or known not to)
+ */
+static gboolean is_baudrate_set(struct AtQueueEntry *entry)
+{
+    if (entry->command != &probe_command && entry->command != &ipr_command)
+        return FALSE;
+
+    if (at_port && at_port->usb)
+        return TRUE;
+
+    if (entry->command == &probe_command)
+        return baud_verified;
+
+    return baud_failed || uart_baudrate == target_baudrate;
+}
+
+static void tx_reset(struct EG25Manager *manager)
+{
+    if (manager->at_write_source) {
+        g_source_remove(manager->at_write_source);
+        manager->at_write_source = 0;
+    }
+    if (wake_timer) {
+        g_source_remove(wake_timer);
+        wake_timer = 0;
+    }
+    tx_buffer.head = 0;
+    tx_buffer.len = 0;
+    if (uart_rate_pending)
+        apply_uart_baudrate();
+}
+
+/*
+ * Write as much pending output as possible; returns TRUE once everything has
+ * been written (or dropped because of a write error)
+ */
+static gboolean tx_flush(struct EG25Manager *manager)
+{
+    struct AtQueueEntry *at_cmd;
+
+    while (tx_buffer.head < tx_buffer.len) {
+        ssize_t ret = write(manager->at_fd, &tx_buffer.data[tx_buffer.head],
+                            tx_buffer.len - tx_buffer.head);
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && errno == EAGAIN)
+            return FALSE;
+        if (ret < 0) {
+            // The command will time out and be sent again
+            g_warning("Couldn't write to AT port: %s", g_strerror(errno));
+            tx_buffer.head = 0;
+            tx_buffer.len = 0;
+            if (uart_rate_pending)
+                apply_uart_baudrate();
+            return TRUE;
+        }
+
+        at_trace_record(manager, AT_TRACE_TX, &tx_buffer.data[tx_buffer.head], ret);
+        tx_buffer.head += ret;
+    }
+
+    tx_buffer.head = 0;
+    tx_buffer.len = 0;
+    if (uart_rate_pending)
+        apply_uart_baudrate();
+
+    at_cmd = queue_peek(at_current, 0);
+    if (at_cmd) {
+        at_cmd->written_time = g_get_monotonic_time();
+        if (at_cmd->written_time - at_cmd->sent_time > G_USEC_PER_SEC / 10)
+            g_message("Command %s took %" G_GINT64_FORMAT " ms to be written",
+                      at_cmd->command->cmd, (at_cmd->written_time - at_cmd->sent_time) / 1000);
+    }
+
+    return TRUE;
+}
+
+static gboolean tx_writable(gint fd, GIOCondition event, gpointer data)
+{
+    struct EG25Manager *manager = data;
+
+    if (!tx_flush(manager))
+        return G_SOURCE_CONTINUE;
+
+    manager->at_write_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void tx_start(struct EG25Manager *manager)
+{
+    if (!tx_flush(manager) && !manager->at_write_source)
+        manager->at_write_source = g_unix_fd_add(manager->at_fd, G_IO_OUT, tx_writable, manager);
+}
+
+static gboolean wake_done(struct EG25Manager *manager)
+{
+    wake_timer = 0;
+    tx_start(manager);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean wake_release(struct EG25Manager *manager)
+{
+    wake_release_timer = 0;
+    wake_held = FALSE;
+    gpio_modem_release(manager);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Queue `data` for writing to the current port; returns FALSE if it can't be
+ * queued because the previous command line is still being written
+ */
+static gboolean tx_write(struct EG25Manager *manager, const char *data, gsize len)
+{
+    if (tx_buffer.len > 0 || len > AT_TX_BUFFER_SIZE)
+        return FALSE;
+
+    memcpy(tx_buffer.data, data, len);
+    tx_buffer.len = len;
+
+    if (wake_release_timer) {
+        g_source_remove(wake_release_timer);
+        wake_release_timer = 0;
+    }
+
+    // The first bytes would be lost if the modem is asleep
+    if (wake_delay > 0 && at_port && !at_port->usb && gpio_modem_wake(manager)) {
+        wake_held = TRUE;
+        wake_time = g_get_monotonic_time();
+        wake_timer = g_timeout_add(wake_delay, G_SOURCE_FUNC(wake_done), manager);
+        return TRUE;
+    }
+
+    tx_start(manager);
+
+    return TRUE;
+}
+
+static gboolean should_skip(struct EG25Manager *manager, struct AtQueueEntry *entry)
+{
+    if (is_baudrate_set(entry))
+        return TRUE;
+
+    if (!is_supported(manager, entry)) {
+        g_message("Skipping command %s, not supported by firmware %s",
+                  entry->command->cmd, manager->modem_firmware);
+        return TRUE;
+    }
+
+    if (is_cached(entry)) {
+        g_message("Skipping command %s, value is known to be set", entry->command->cmd);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean send_at_command(struct EG25Manager *manager)
+{
+    char command[AT_COMMAND_MAX_LENGTH];
+    struct AtQueueEntry *at_cmd;
+    int len = 0, timeout = 0;
+    const char *data;
+
+    at_batch_size = 0;
+    at_current = NULL;
+    at_cmd = NULL;
+
+    for (enum AtPriority prio = 0; prio < AT_PRIORITY_COUNT; prio++) {
+        struct AtQueue *queue = &at_queues[prio];
+
+        if (queue->len > 0 && is_obsolete(manager, prio))
+            queue_cancel(queue, 0);
+
+        // Drop commands the firmware doesn't support and queries whose result is already known
+        while ((at_cmd = queue_peek(queue, 0)) && should_skip(manager, at_cmd))
+            queue_remove(queue, 0);
+
+        if (!at_cmd) {
+            if (queue->active) {
+                queue->active = FALSE;
+                sequence_done(manager, prio);
+            }
+            continue;
+        }
+
+        if (is_paused(manager, prio)) {
+            at_cmd = NULL;
+            continue;
+        }
+
+        at_current = queue;
+        break;
+    }
+
+    if (at_cmd) {
+        const struct AtCommandLine *line = get_command_line(at_cmd);
+
+        data = line->data;
+        len = line->len;
+        timeout = at_cmd->command->timeout;
+        at_batch_size = 1;
+
+        if (at_cmd->batch) {
+            guint i = 1;
+
+            // Chain following commands, stripping their "AT" prefix and CRLF
+            len -= 2;
+            memcpy(command, line->data, len);
+
+            while (i < at_current->len) {
+                struct AtQueueEntry *entry = queue_peek(at_current, i);
+
+                if (!entry->batch)
+                    break;
+
+                if (should_skip(manager, entry)) {
+                    queue_remove(at_current, i);
+                    continue;
+                }
+
+                line = get_command_line(entry);
+                if (len + 1 + (line->len - 4) + 2 > sizeof(command))
+                    break;
+
+                command[len++] = ';';
+                memcpy(&command[len], line->data + 2, line->len - 4);
+                len += line->len - 4;
+                timeout += entry->command->timeout;
+                at_batch_size++;
+                i++;
+            }
+
+            memcpy(&command[len], "\r\n", 2);
+            len += 2;
+            data = command;
+        }
+
+        // The response to ATV0 already uses numeric result codes
+        if (at_cmd->command == &session_command && session_numeric)
+            rx_numeric = TRUE;
+
+        g_message("Sending command: %.*s", len - 2, data);
+
+        at_cmd->sent_time = g_get_monotonic_time();
+        at_cmd->written_time = 0;
+        if (!transport_select(manager))
+            g_warning("No usable AT port, can't send command");
+        else if (!tx_write(manager, data, len))
+            g_warning("Previous command still being written, holding back command");
+
+        if (manager->at_timeout_timer)
+            g_source_remove(manager->at_timeout_timer);
+        manager->at_timeout_timer = g_timeout_add(timeout,
+                                                  G_SOURCE_FUNC(at_command_timeout),
+                                                  manager);
+    } else if (wake_held && !wake_release_timer) {
+        wake_release_timer = g_timeout_add(wake_idle, G_SOURCE_FUNC(wake_release), manager);
+    }
+
+    return FALSE;
+}
+
+static void next_at_command(struct EG25Manager *manager)
+{
+    if (!queue_peek(at_current, 0))
+        return;
+
+    queue_remove(at_current, 0);
+
+    send_at_command(manager);
+}
+
+static gboolean resend_at_command(struct EG25Manager *manager)
+{
+    manager->at_retry_timer = 0;
+    return send_at_command(manager);
+}
+
+static gboolean is_permanent_error(const char *error)
+{
+    const char *code;
+
+    if (!error || !g_str_has_prefix(error, "+CME ERROR:"))
+        return FALSE;
+
+    code = error + strlen("+CME ERROR:");
+    while (*code == ' ')
+        code++;
+    if (!g_ascii_isdigit(*code))
+        return FALSE;
+
+    for (guint i = 0; i < G_N_ELEMENTS(permanent_cme_errors); i++) {
+        if (atoi(code) == permanent_cme_errors[i])
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+static guint retry_delay(const struct AtRetryPolicy *policy, int retries)
+{
+    double delay = policy->delay;
+
+    for (int i = 1; i < retries && delay < AT_MAX_RETRY_DELAY; i++)
+        delay *= policy->backoff;
+
+    delay = MIN(delay, AT_MAX_RETRY_DELAY);
+    if (policy->jitter > 0)
+        delay += g_random_int_range(0, policy->jitter + 1);
+
+    return (guint)delay;
+}
+
+/*
+ * Complete the request at the head of the current queue: the next command is
+ * sent before calling the request's callback, so the latter can queue new
+ * requests right away
+ */
+static void request_complete(struct EG25Manager  *manager,
+                             struct AtQueueEntry *at_cmd,
+                             const char          *response,
+                             const char          *error)
+{
+    struct AtRequest *request = at_cmd->request;
+    g_autofree gchar *result = g_strdup(error);
+
+    at_cmd->request = NULL;
+    next_at_command(manager);
+    request_finish(request, response, result);
+}
+
+/*
+ * `error` is the final result code of the failed command, or NULL if it
+ * timed out
+ */
+static void abort_at_command(struct EG25Manager  *manager,
+                             struct AtQueueEntry *at_cmd,
+                             const char          *error)
+{
+    if (at_cmd->request) {
+        request_complete(manager, at_cmd, NULL, error ? error : "TIMEOUT");
+        return;
+    }
+
+    if (at_cmd->command->abort_callback)
+        at_cmd->command->abort_callback(manager);
+    next_at_command(manager);
+}
+
+/*
+ * `error` is the final result code of the failed command, or NULL if it
+ * timed out
+ */
+static void retry_at_command(struct EG25Manager *manager, const char *error)
+{
+    struct AtQueueEntry *at_cmd = queue_peek(at_current, 0);
+    const struct AtRetryPolicy *policy;
+    guint delay;
+
+    if (!at_cmd)
+        return;
+
+    if (at_batch_size > 1) {
+        // We can't tell which command failed, send them one at a time
+        g_message("Batched commands failed, falling back to single commands");
+        for (guint i = 0; i < at_batch_size; i++)
+            queue_peek(at_current, i)->batch = FALSE;
+        send_at_command(manager);
+        return;
+    }
+
+    if (is_permanent_error(error)) {
+        g_critical("Command %s failed with %s, aborting...", at_cmd->command->cmd, error);
+        abort_at_command(manager, at_cmd, error);
+        return;
+    }
+
+    policy = &at_cmd->command->retry;
+    at_cmd->retries++;
+    if (at_cmd->retries > policy->retries) {
+        g_critical("Command %s retried %d times, aborting...", at_cmd->command->cmd, at_cmd->retries);
+        abort_at_command(manager, at_cmd, error);
+    } else {
+        if (at_cmd->command->retry_callback)
+            at_cmd->command->retry_callback(manager, at_cmd->retries);
+        delay = retry_delay(policy, at_cmd->retries);
+        g_message("Retrying command %s in %u ms", at_cmd->command->cmd, delay);
+        manager->at_retry_timer = g_timeout_add(delay, G_SOURCE_FUNC(resend_at_command), manager);
+    }
+}
+
+static gboolean at_command_timeout(struct EG25Manager *manager)
+{
+    struct AtQueueEntry *at_cmd = queue_peek(at_current, 0);
+
+    manager->at_timeout_timer = 0;
+    if (!at_cmd)
+        return FALSE;
+
+    g_warning("Command %s got no response after %" G_GINT64_FORMAT " ms",
+              at_cmd->command->cmd, (g_get_monotonic_time() - at_cmd->sent_time) / 1000);
+
+    if (at_port && at_port->usb && ++at_port->timeouts >= AT_PORT_MAX_TIMEOUTS)
+        port_failed(manager, at_port);
+
+    // Drop any partial response, it will be sent again if we retry
+    g_string_truncate(rx_response, 0);
+    retry_at_command(manager, NULL);
+
+    return FALSE;
+}
+
+/*
+ * Stop waiting for the current command, either because its response has
+ * just been received or because the command queue is being torn down.
+ */
+static void cancel_at_timers(struct EG25Manager *manager)
+{
+    if (manager->at_timeout_timer) {
+        g_source_remove(manager->at_timeout_timer);
+        manager->at_timeout_timer = 0;
+    }
+    if (manager->at_retry_timer) {
+        g_source_remove(manager->at_retry_timer);
+        manager->at_retry_timer = 0;
+    }
+}
+
+static void clear_field(struct AtField *field)
+{
+    g_free(field->value);
+}
+
+/*
+ * Split the comma-separated arguments of a response or `expect` value into
+ * fields; returns NULL if they are malformed (e.g. unterminated string)
+ */
+static GArray *parse_fields(const char *args, gsize len)
+{
+    const char *end = args + len;
+    GArray *fields = g_array_new(FALSE, TRUE, sizeof(struct AtField));
+
+    g_array_set_clear_func(fields, (GDestroyNotify)clear_field);
+
+    for (;;) {
+        struct AtField field = { 0 };
+        const char *stop;
+
+        while (args < end && *args == ' ')
+            args++;
+
+        if (args < end && *args == '"') {
+            stop = memchr(args + 1, '"', end - args - 1);
+            if (!stop) {
+                g_array_unref(fields);
+                return NULL;
+            }
+            field.quoted = TRUE;
+            field.value = g_strndup(args + 1, stop - args - 1);
+            args = stop + 1;
+            while (args < end && *args == ' ')
+                args++;
+        } else {
+            stop = memchr(args, ',', end - args);
+            if (!stop)
+                stop = end;
+            while (stop > args && stop[-1] == ' ')
+                stop--;
+            field.value = g_strndup(args, stop - args);
+            args = stop;
+            while (args < end && *args == ' ')
+                args++;
+        }
+        g_array_append_val(fields, field);
+
+        if (args >= end)
+            break;
+        if (*args != ',') {
+            g_array_unref(fields);
+            return NULL;
+        }
+        args++;
+    }
+
+    return fields;
+}
+
+/*
+ * Check whether the arguments of a response line start with the subcommand
+ * of `at_cmd` as a quoted field
+ */
+static gboolean line_has_subcmd(const struct AtCommand *at_cmd, const char *args, gsize len)
+{
+    g_autoptr(GArray) fields = parse_fields(args, len);
+    const struct AtField *field;
+
+    if (!fields)
+        return FALSE;
+
+    field = &g_array_index(fields, struct AtField, 0);
+    return field->quoted && strcmp(field->value, at_cmd->subcmd) == 0;
+}
+
+/*
+ * Find the line of `response` answering `at_cmd`, which starts with the
+ * command prefix followed by the subcommand, if any (e.g. `+QCFG: "ims",1`).
+ * Batched commands share the same response, so a line for another subcommand
+ * is never a match. Commands without a subcommand and with no such line (e.g.
+ * answering with a bare value) get the first line which is neither the
+ * command echo nor a final result code.
+ */
+static const char *find_response_line(const struct AtCommand *at_cmd,
+                                      const char             *response,
+                                      gsize                  *len)
+{
+    gsize cmd_len = strlen(at_cmd->cmd);
+    const char *fallback = NULL;
+    gsize fallback_len = 0;
+
+    while (*response) {
+        const char *line = response;
+        gsize line_len = strcspn(line, "\r\n");
+
+        response += line_len;
+        response += strspn(response, "\r\n");
+        if (line_len == 0)
+            continue;
+
+        if (line[0] == '+' && line_len > cmd_len + 1 &&
+            strncmp(line + 1, at_cmd->cmd, cmd_len) == 0 && line[cmd_len + 1] == ':') {
+            if (at_cmd->subcmd &&
+                !line_has_subcmd(at_cmd, line + cmd_len + 2, line_len - cmd_len - 2))
+                continue;
+            *len = line_len;
+            return line;
+        }
+
+        if (!fallback && !at_cmd->subcmd && line[0] != '+' && strncmp(line, "AT", 2) != 0 &&
+            !(line_len == 2 && strncmp(line, "OK", 2) == 0) &&
+            !(line_len == 5 && strncmp(line, "ERROR", 5) == 0)) {
+            fallback = line;
+            fallback_len = line_len;
+        }
+    }
+
+    *len = fallback_len;
+    return fallback;
+}
+
+static gboolean fields_equal(const struct AtField *a, const struct AtField *b)
+{
+    return a->quoted == b->quoted && strcmp(a->value, b->value) == 0;
+}
+
+/*
+ * Check whether `response` reports the expected value for `at_cmd`, comparing
+ * each field individually: the expected fields must be the first ones of the
+ * response, so `"ims",1,0` matches an `expect` of `1` but `"ims",10` doesn't
+ */
+static gboolean response_matches(const struct AtCommand *at_cmd, const char *response)
+{
+    g_autoptr(GArray) fields = NULL;
+    const struct AtField *field;
+    const char *line;
+    gsize len, offset = 0;
+
+    line = find_response_line(at_cmd, response, &len);
+    if (!line)
+        return FALSE;
+
+    if (line[0] == '+') {
+        offset = strlen(at_cmd->cmd) + 2;
+        line += offset;
+        len -= offset;
+    }
+
+    fields = parse_fields(line, len);
+    if (!fields)
+        return FALSE;
+
+    // The subcommand is echoed as the first field, check it then skip it
+    offset = 0;
+    if (at_cmd->subcmd) {
+        field = &g_array_index(fields, struct AtField, 0);
+        if (!field->quoted || strcmp(field->value, at_cmd->subcmd) != 0)
+            return FALSE;
+        offset = 1;
+    }
+
+    // The modem may report trailing read-only fields (e.g. VoLTE state for ims)
+    if (fields->len - offset < at_cmd->expected_fields->len)
+        return FALSE;
+
+    for (guint i = 0; i < at_cmd->expected_fields->len; i++) {
+        if (!fields_equal(&g_array_index(fields, struct AtField, i + offset),
+                          &g_array_index(at_cmd->expected_fields, struct AtField, i)))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * Strip the command echo and the final result code from `response`, leaving
+ * only the information lines
+ */
+static gchar *get_response_body(const struct AtCommand *at_cmd, const char *response)
+{
+    g_auto(GStrv) lines = g_strsplit(response, "\r\n", -1);
+    gsize echo_len = at_cmd->query.len - 2;
+    GString *body = g_string_new(NULL);
+    guint count = g_strv_length(lines);
+
+    // The last line is always the final result code
+    for (guint i = 0; i + 1 < count; i++) {
+        if (strlen(lines[i]) == echo_len && strncmp(lines[i], at_cmd->query.data, echo_len) == 0)
+            continue;
+
+        if (body->len > 0)
+            g_string_append(body, "\r\n");
+        g_string_append(body, lines[i]);
+    }
+
+    return g_string_free(body, FALSE);
+}
+
+static void process_at_result(struct EG25Manager *manager, char *response)
+{
+    struct AtQueueEntry *at_cmd = queue_peek(at_current, 0);
+    gboolean matches = FALSE;
+
+    if (!at_cmd)
+        return;
+
+    if (at_cmd->request) {
+        g_autofree gchar *body = get_response_body(at_cmd->command, response);
+
+        request_complete(manager, at_cmd, body, NULL);
+        return;
+    }
+
+    if (at_cmd->command->callback)
+        at_cmd->command->callback(manager, response);
+
+    if (at_cmd->expected) {
+        g_autofree gchar *key = cache_key(at_cmd);
+
+        matches = response_matches(at_cmd->command, response);
+        if (matches) {
+            at_cache_set_verified(key, at_cmd->expected);
+        } else {
+            at_cache_mismatch(key);
+        }
+    }
+
+    if (at_cmd->expected && !matches) {
+        g_message("Got a different result than expected, changing value...");
+        g_message("\t%s\n\t%s", at_cmd->expected, response);
+        at_cmd->value = at_cmd->expected;
+        at_cmd->expected = NULL;
+        send_at_command(manager);
+    } else {
+        next_at_command(manager);
+    }
+}
+
+static void process_batch_result(struct EG25Manager *manager, const char *response)
+{
+    guint i = 0;
+
+    for (guint n = 0; n < at_batch_size; n++) {
+        struct AtQueueEntry *at_cmd = queue_peek(at_current, i);
+
+        if (at_cmd->expected) {
+            g_autofree gchar *key = cache_key(at_cmd);
+
+            if (!response_matches(at_cmd->command, response)) {
+                const char *line;
+                gsize len = 0;
+
+                line = find_response_line(at_cmd->command, response, &len);
+                at_cache_mismatch(key);
+                g_message("Got a different result than expected for %s, changing value...",
+                          at_cmd->command->cmd);
+                g_message("\t%s\n\t%.*s", at_cmd->expected, (int)len, line ? line : "");
+                at_cmd->value = at_cmd->expected;
+                at_cmd->expected = NULL;
+                i++;
+                continue;
+            }
+
+            at_cache_set_verified(key, at_cmd->expected);
+        }
+
+        queue_remove(at_current, i);
+    }
+
+    send_at_command(manager);
+}
+
+/*
+ * Return the final result code `line` stands for, converted to its verbose
+ * form if it's a numeric result code, or NULL if it isn't a final result code
+ */
+static const char *final_result(const char *line)
+{
+    if (strcmp(line, "OK") == 0 || strcmp(line, "ERROR") == 0 ||
+        g_str_has_prefix(line, "+CME ERROR:") ||
+        g_str_has_prefix(line, "+CMS ERROR:"))
+        return line;
+
+    if (rx_numeric && line[0] && !line[1]) {
+        switch (line[0]) {
+        case '0':
+            return "OK";
+        case '3': // NO CARRIER
+        case '4':
+        case '6': // NO DIALTONE
+        case '7': // BUSY
+        case '8': // NO ANSWER
+            return "ERROR";
+        }
+    }
+
+    return NULL;
+}
+
+static gboolean is_final_result(const char *line)
+{
+    return final_result(line) != NULL;
+}
+
+/*
+ * Return the first line of `response` which is neither the command echo nor
+ * the final result code, e.g. the firmware revision for AT+QGMR
+ */
+static gchar *get_response_value(const char *response)
+{
+    g_auto(GStrv) lines = g_strsplit(response, "\r\n", -1);
+
+    for (guint i = 0; lines[i]; i++) {
+        if (g_str_has_prefix(lines[i], "AT") || is_final_result(lines[i]))
+            continue;
+
+        return g_strdup(lines[i]);
+    }
+
+    return NULL;
+}
+
+static void update_cache_modem(struct EG25Manager *manager)
+{
+    if (manager->modem_firmware && manager->modem_imei)
+        at_cache_set_modem(manager->modem_firmware, manager->modem_imei);
+}
+
+static void store_firmware(struct EG25Manager *manager, const char *response)
+{
+    g_free(manager->modem_firmware);
+    manager->modem_firmware = get_response_value(response);
+    g_message("Modem firmware revision: %s", manager->modem_firmware);
+    update_cache_modem(manager);
+}
+
+static void store_imei(struct EG25Manager *manager, const char *response)
+{
+    g_free(manager->modem_imei);
+    manager->modem_imei = get_response_value(response);
+    update_cache_modem(manager);
+}
+
+static void baudrate_probed(struct EG25Manager *manager, const char *response)
+{
+    baud_verified = TRUE;
+    g_message("Modem answering at %u bauds", uart_baudrate);
+}
+
+// Alternate between the target and default rates until the modem answers
+static void baudrate_probe_retry(struct EG25Manager *manager, int retries)
+{
+    set_uart_baudrate(uart_baudrate == target_baudrate ? AT_DEFAULT_BAUDRATE : target_baudrate);
+}
+
+static void baudrate_failed(struct EG25Manager *manager)
+{
+    g_warning("UART rate negotiation failed, falling back to %d bauds", AT_DEFAULT_BAUDRATE);
+    baud_failed = TRUE;
+    baud_verified = FALSE;
+    set_uart_baudrate(AT_DEFAULT_BAUDRATE);
+}
+
+// The modem switches to the new rate right after acknowledging AT+IPR
+static void baudrate_switched(struct EG25Manager *manager, const char *response)
+{
+    baud_verified = FALSE;
+    set_uart_baudrate(target_baudrate);
+}
+
+static ssize_t rx_ring_fill(struct EG25Manager *manager, int fd)
+{
+    gsize tail, avail;
+    ssize_t ret;
+
+    if (rx_ring.len == AT_RX_BUFFER_SIZE)
+        return 0;
+
+    tail = (rx_ring.head + rx_ring.len) % AT_RX_BUFFER_SIZE;
+    if (tail >= rx_ring.head)
+        avail = AT_RX_BUFFER_SIZE - tail;
+    else
+        avail = rx_ring.head - tail;
+
+    ret = read(fd, &rx_ring.data[tail], avail);
+    if (ret > 0) {
+        at_trace_record(manager, AT_TRACE_RX, &rx_ring.data[tail], ret);
+        rx_ring.len += ret;
+
+        if (wake_time) {
+            gint64 latency = g_get_monotonic_time() - wake_time;
+
+            wake_latency_last = latency / 1000;
+            wake_latency_total += wake_latency_last;
+            wake_latency_count++;
+            at_trace_wake(manager, latency);
+            g_message("Modem answered %u ms after being woken up (%" G_GUINT64_FORMAT " ms on average)",
+                      wake_latency_last, wake_latency_total / wake_latency_count);
+            wake_time = 0;
+        }
     }
 
-    return fd;
+    return ret;
 }
 
-static gboolean send_at_command(struct EG25Manager *manager)
+static void rx_ring_consume(GString *line, gsize count)
 {
-    char command[256];
-    struct AtCommand *at_cmd = manager->at_cmds ? g_list_nth_data(manager->at_cmds, 0) : NULL;
-    int ret, len = 0;
+    gsize first = MIN(count, AT_RX_BUFFER_SIZE - rx_ring.head);
 
-    if (at_cmd) {
-        if (at_cmd->subcmd == NULL && at_cmd->value == NULL && at_cmd->expected == NULL)
-            len = sprintf(command, "AT+%s\r\n", at_cmd->cmd);
-        else if (at_cmd->subcmd == NULL && at_cmd->value == NULL)
-            len = sprintf(command, "AT+%s?\r\n", at_cmd->cmd);
-        else if (at_cmd->subcmd == NULL && at_cmd->value)
-            len = sprintf(command, "AT+%s=%s\r\n", at_cmd->cmd, at_cmd->value);
-        else if (at_cmd->subcmd && at_cmd->value == NULL)
-            len = sprintf(command, "AT+%s=\"%s\"\r\n", at_cmd->cmd, at_cmd->subcmd);
-        else if (at_cmd->subcmd && at_cmd->value)
-            len = sprintf(command, "AT+%s=\"%s\",%s\r\n", at_cmd->cmd, at_cmd->subcmd, at_cmd->value);
-
-        ret = write(manager->at_fd, command, len);
-        if (ret < len)
-            g_warning("Couldn't write full AT command: wrote %d/%d bytes", ret, len);
-
-        g_message("Sending command: %s", g_strstrip(command));
-    } else if (manager->modem_state < EG25_STATE_CONFIGURED) {
-        if (manager->modem_iface == MODEM_IFACE_MODEMMANAGER) {
-            MMModemState modem_state = mm_modem_get_state(manager->mm_modem);
+    g_string_append_len(line, &rx_ring.data[rx_ring.head], first);
+    if (count > first)
+        g_string_append_len(line, rx_ring.data, count - first);
 
-            if (manager->mm_modem && modem_state >= MM_MODEM_STATE_REGISTERED)
-                modem_update_state(manager, modem_state);
-            else
-                manager->modem_state = EG25_STATE_CONFIGURED;
-        } else {
-            manager->modem_state = EG25_STATE_CONFIGURED;
+    rx_ring.head = (rx_ring.head + count) % AT_RX_BUFFER_SIZE;
+    rx_ring.len -= count;
+}
+
+/*
+ * Move the next line (without its terminator) from the ring buffer to `line`.
+ * Returns FALSE if no complete line is available yet, in which case partial
+ * data is kept for the next call, unless the ring buffer is full.
+ */
+static gboolean rx_ring_pop_line(GString *line)
+{
+    for (gsize i = 0; i < rx_ring.len; i++) {
+        char c = rx_ring.data[(rx_ring.head + i) % AT_RX_BUFFER_SIZE];
+
+        if (c == '\r' || c == '\n') {
+            rx_ring_consume(line, i);
+            // Drop the terminator too
+            rx_ring.head = (rx_ring.head + 1) % AT_RX_BUFFER_SIZE;
+            rx_ring.len--;
+            return TRUE;
         }
-    } else if (manager->modem_state == EG25_STATE_SUSPENDING) {
-        modem_suspend_post(manager);
-    } else if (manager->modem_state == EG25_STATE_RESETTING) {
-        manager->modem_state = EG25_STATE_POWERED;
     }
 
+    // Line is longer than the ring buffer, move what we have out of the way
+    if (rx_ring.len == AT_RX_BUFFER_SIZE)
+        rx_ring_consume(line, rx_ring.len);
+
     return FALSE;
 }
 
-static void next_at_command(struct EG25Manager *manager)
+/*
+ * A line is part of the response to the commands in flight if it starts with
+ * one of those commands' own prefix (e.g. "+QCFG:" after "AT+QCFG?")
+ */
+static gboolean is_solicited(const char *line)
 {
-    struct AtCommand *at_cmd = manager->at_cmds ? g_list_nth_data(manager->at_cmds, 0) : NULL;
-
-    if (!at_cmd)
-        return;
+    for (guint i = 0; i < MAX(at_batch_size, 1) && queue_peek(at_current, i); i++) {
+        const char *cmd = queue_peek(at_current, i)->command->cmd;
+        gsize len = strlen(cmd);
 
-    if (at_cmd->cmd)
-        g_free(at_cmd->cmd);
-    if (at_cmd->subcmd)
-        g_free(at_cmd->subcmd);
-    if (at_cmd->value)
-        g_free(at_cmd->value);
-    if (at_cmd->expected)
-        g_free(at_cmd->expected);
-    g_free(at_cmd);
-    manager->at_cmds = g_list_remove(manager->at_cmds, at_cmd);
+        if (line[0] == '+' && strncmp(&line[1], cmd, len) == 0 && line[len + 1] == ':')
+            return TRUE;
+    }
 
-    send_at_command(manager);
+    return FALSE;
 }
 
-static void retry_at_command(struct EG25Manager *manager)
+static gboolean is_known_urc(const char *line)
 {
-    struct AtCommand *at_cmd = manager->at_cmds ? g_list_nth_data(manager->at_cmds, 0) : NULL;
-
-    if (!at_cmd)
-        return;
-
-    at_cmd->retries++;
-    if (at_cmd->retries > 3) {
-        g_critical("Command %s retried %d times, aborting...", at_cmd->cmd, at_cmd->retries);
-        next_at_command(manager);
-    } else {
-        g_timeout_add(500, G_SOURCE_FUNC(send_at_command), manager);
+    for (guint i = 0; i < G_N_ELEMENTS(known_urcs); i++) {
+        if (g_str_has_prefix(line, known_urcs[i]))
+            return TRUE;
     }
+
+    return FALSE;
 }
 
-static void process_at_result(struct EG25Manager *manager, char *response)
+/*
+ * Classify `line` and hand it over to the matching URC handlers if it isn't
+ * part of the current command's response. Returns TRUE if the line has been
+ * consumed as an URC.
+ */
+static gboolean process_urc(struct EG25Manager  *manager,
+                            struct AtQueueEntry *at_cmd,
+                            const char          *line)
 {
-    struct AtCommand *at_cmd = manager->at_cmds ? g_list_nth_data(manager->at_cmds, 0) : NULL;
+    gboolean handled = FALSE;
 
-    if (!at_cmd)
-        return;
+    if (at_cmd && is_solicited(line))
+        return FALSE;
 
-    if (at_cmd->expected && !strstr(response, at_cmd->expected)) {
-        if (at_cmd->value)
-            g_free(at_cmd->value);
-        at_cmd->value = at_cmd->expected;
-        at_cmd->expected = NULL;
-        g_message("Got a different result than expected, changing value...");
-        g_message("\t%s\n\t%s", at_cmd->expected, response);
-        send_at_command(manager);
-    } else {
-        next_at_command(manager);
+    for (guint i = 0; i < urc_handlers->len; i++) {
+        struct AtUrcHandler *handler = &g_array_index(urc_handlers, struct AtUrcHandler, i);
+
+        if (g_str_has_prefix(line, handler->prefix)) {
+            handler->callback(manager, line, handler->user_data);
+            handled = TRUE;
+        }
     }
+
+    if (handled)
+        return TRUE;
+
+    // Anything we don't know of is considered part of the current response
+    if (at_cmd && !is_known_urc(line))
+        return FALSE;
+
+    g_message("Unhandled URC: [%s]", line);
+
+    return TRUE;
 }
 
-static int append_at_command(struct EG25Manager *manager,
-                             const char         *cmd,
-                             const char         *subcmd,
-                             const char         *value,
-                             const char         *expected)
+static void process_at_line(struct EG25Manager *manager, const char *line)
 {
-    struct AtCommand *at_cmd = calloc(1, sizeof(struct AtCommand));
+    struct AtQueueEntry *at_cmd = queue_peek(at_current, 0);
+    const char *result;
 
-    if (!at_cmd)
-        return -1;
+    // The modem may output garbage while booting, not followed by a line break
+    if (g_str_has_suffix(line, "RDY") && strcmp(line, "RDY") != 0) {
+        g_message("Found RDY after unexpected output: [%s]", line);
+        line += strlen(line) - strlen("RDY");
+    }
+
+    if (process_urc(manager, at_cmd, line))
+        return;
+
+    if (rx_response->len > 0)
+        g_string_append(rx_response, "\r\n");
+    g_string_append(rx_response, line);
 
-    at_cmd->cmd = g_strdup(cmd);
-    if (subcmd)
-        at_cmd->subcmd = g_strdup(subcmd);
-    if (value)
-        at_cmd->value = g_strdup(value);
-    if (expected)
-        at_cmd->expected = g_strdup(expected);
+    result = final_result(line);
+    if (!result)
+        return;
 
-    manager->at_cmds = g_list_append(manager->at_cmds, at_cmd);
+    cancel_at_timers(manager);
+    if (at_port)
+        at_port->timeouts = 0;
+    g_message("Response: [%s]", rx_response->str);
+    g_debug("Command %s answered in %" G_GINT64_FORMAT " ms (%" G_GINT64_FORMAT " ms after being written)",
+            at_cmd->command->cmd, (g_get_monotonic_time() - at_cmd->sent_time) / 1000,
+            at_cmd->written_time ? (g_get_monotonic_time() - at_cmd->written_time) / 1000 : -1);
 
-    return 0;
+    if (strcmp(result, "OK") == 0 && at_batch_size > 1)
+        process_batch_result(manager, rx_response->str);
+    else if (strcmp(result, "OK") == 0)
+        process_at_result(manager, rx_response->str);
+    else
+        retry_at_command(manager, result);
+
+    g_string_truncate(rx_response, 0);
 }
 
-#define READ_BUFFER_SIZE 256
+static void modem_ready(struct EG25Manager *manager,
+                        const char         *urc,
+                        gpointer            user_data)
+{
+    g_message("Modem is ready: [%s]", urc);
+    // Echo and verbose result codes are enabled again on boot
+    rx_numeric = FALSE;
+    baud_verified = FALSE;
+    modem_started(manager, "RDY");
+}
 
 static gboolean modem_response(gint fd,
                                GIOCondition event,
                                gpointer data)
 {
     struct EG25Manager *manager = data;
-    char response[READ_BUFFER_SIZE*4+1];
-    char tmp[READ_BUFFER_SIZE];
-    ssize_t ret, pos = 0;
 
     /*
-     * Several reads can be necessary to get the full response, so we loop
-     * until we read 0 chars with a reasonable delay between attempts
-     * (remember the transfer rate is 115200 here)
+     * The fd is non-blocking: drain everything that is currently available
+     * and hand over complete lines, keeping partial ones for the next event
      */
-    do {
-        ret = read(fd, tmp, sizeof(tmp));
-        if (ret > 0) {
-            memcpy(&response[pos], tmp, ret);
-            pos += ret;
-            usleep(10000);
+    while (rx_ring_fill(manager, fd) > 0) {
+        while (rx_ring_pop_line(rx_line)) {
+            g_strstrip(rx_line->str);
+            if (strlen(rx_line->str) > 0)
+                process_at_line(manager, rx_line->str);
+            g_string_truncate(rx_line, 0);
         }
-    } while (ret > 0 && pos < (sizeof(response) - 1));
+    }
 
-    if (pos > 0) {
-        response[pos] = 0;
-        g_strstrip(response);
-        if (strlen(response) == 0)
-            return TRUE;
+    if (event & (G_IO_HUP | G_IO_ERR)) {
+        // The source is removed by returning FALSE
+        manager->at_source = 0;
+
+        if (at_port && at_port->usb) {
+            port_failed(manager, at_port);
+        } else if (at_port) {
+            // The UART will be reopened when sending the next command
+            g_critical("Error on AT port %s", at_port->path);
+            port_close(manager, at_port);
+        }
 
-        g_message("Response: [%s]", response);
+        /*
+         * Switch to the fallback port right away, as the modem may be
+         * rebooting and we need to catch its RDY on the UART
+         */
+        transport_select(manager);
 
-        if (strcmp(response, "RDY") == 0) {
-            suspend_inhibit(manager, TRUE, TRUE);
-            manager->modem_state = EG25_STATE_STARTED;
+        // Don't wait for the command in flight to time out, resend it right away
+        if (at_command_pending(manager)) {
+            cancel_at_timers(manager);
+            g_string_truncate(rx_response, 0);
+            send_at_command(manager);
         }
-        else if (strstr(response, "ERROR"))
-            retry_at_command(manager);
-        else if (strstr(response, "OK"))
-            process_at_result(manager, response);
-        else
-            // Not a recognized response, try running next command, just in case
-            next_at_command(manager);
+
+        return FALSE;
     }
 
     return TRUE;
 }
 
-static void parse_commands_list(toml_array_t *array, GArray **cmds)
+/*
+ * Compute a checksum of the configure commands list, so cached results can be
+ * discarded whenever the configuration changes
+ */
+static gchar *hash_commands_list(GArray *cmds)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    gchar *hash;
+
+    for (guint i = 0; i < cmds->len; i++) {
+        struct AtCommand *cmd = &g_array_index(cmds, struct AtCommand, i);
+        g_autofree gchar *entry = g_strdup_printf("%s%s|%s|%s|%s\n",
+                                                  cmd->basic ? "AT" : "",
+                                                  cmd->cmd,
+                                                  cmd->subcmd ? cmd->subcmd : "",
+                                                  cmd->value ? cmd->value : "",
+                                                  cmd->expected ? cmd->expected : "");
+
+        g_checksum_update(checksum, (const guchar *)entry, -1);
+    }
+
+    hash = g_strdup(g_checksum_get_string(checksum));
+    g_checksum_free(checksum);
+
+    return hash;
+}
+
+/*
+ * Override the fields of `policy` with those set in the `key` inline table of
+ * `config`, e.g. `retry = { retries = 5, delay = 200, backoff = 2.0 }`
+ */
+static void parse_retry_policy(toml_table_t *config, const char *key, struct AtRetryPolicy *policy)
+{
+    toml_table_t *table = toml_table_in(config, key);
+    toml_datum_t value;
+
+    if (!table)
+        return;
+
+    value = toml_int_in(table, "retries");
+    if (value.ok && value.u.i >= 0)
+        policy->retries = (int)value.u.i;
+
+    value = toml_int_in(table, "delay");
+    if (value.ok && value.u.i >= 0)
+        policy->delay = (int)MIN(value.u.i, AT_MAX_RETRY_DELAY);
+
+    value = toml_double_in(table, "backoff");
+    if (value.ok && value.u.d >= 1.0) {
+        policy->backoff = value.u.d;
+    } else {
+        value = toml_int_in(table, "backoff");
+        if (value.ok && value.u.i >= 1)
+            policy->backoff = (double)value.u.i;
+    }
+
+    value = toml_int_in(table, "jitter");
+    if (value.ok && value.u.i >= 0)
+        policy->jitter = (int)MIN(value.u.i, AT_MAX_RETRY_DELAY);
+}
+
+/*
+ * Parse a `key` element which can be either a single string or an array of
+ * strings, returning NULL if it's missing
+ */
+static GStrv parse_string_list(toml_table_t *table, const char *key)
+{
+    toml_datum_t value = toml_string_in(table, key);
+    toml_array_t *array;
+    GPtrArray *list;
+
+    if (value.ok) {
+        GStrv single = g_new0(gchar *, 2);
+
+        single[0] = g_strdup(value.u.s);
+        free(value.u.s);
+        return single;
+    }
+
+    array = toml_array_in(table, key);
+    if (!array)
+        return NULL;
+
+    list = g_ptr_array_new();
+    for (int i = 0; i < toml_array_nelem(array); i++) {
+        value = toml_string_at(array, i);
+        if (value.ok) {
+            g_ptr_array_add(list, g_strdup(value.u.s));
+            free(value.u.s);
+        }
+    }
+    g_ptr_array_add(list, NULL);
+
+    return (GStrv)g_ptr_array_free(list, FALSE);
+}
+
+static void parse_commands_list(toml_table_t *config, const char *name, GArray **cmds)
 {
+    g_autofree gchar *policy_key = g_strdup_printf("%s_retry", name);
+    struct AtRetryPolicy policy = default_retry_policy;
+    toml_array_t *array;
     int len;
 
+    array = toml_array_in(config, name);
+    if (!array)
+        g_error("Configuration file lacks %s AT commands list", name);
+
+    // Sequence-wide policy, overriding the global one
+    parse_retry_policy(config, "retry", &policy);
+    parse_retry_policy(config, policy_key, &policy);
+
     len = toml_array_nelem(array);
     *cmds = g_array_new(FALSE, TRUE, sizeof(struct AtCommand));
     g_array_set_size(*cmds, (guint)len);
@@ -252,6 +2069,10 @@ static void parse_commands_list(toml_array_t *array, GArray **cmds)
             free(value.u.s);
         }
 
+        value = toml_bool_in(table, "basic");
+        if (value.ok)
+            cmd->basic = value.u.b;
+
         value = toml_string_in(table, "value");
         if (value.ok) {
             cmd->value = g_strdup(value.u.s);
@@ -262,96 +2083,493 @@ static void parse_commands_list(toml_array_t *array, GArray **cmds)
         if (value.ok) {
             cmd->expected = g_strdup(value.u.s);
             free(value.u.s);
+
+            cmd->expected_fields = parse_fields(cmd->expected, strlen(cmd->expected));
+            if (!cmd->expected_fields)
+                g_error("Invalid `expect` value for AT command #%d: %s", i, cmd->expected);
         }
+
+        value = toml_int_in(table, "timeout");
+        cmd->timeout = value.ok && value.u.i > 0 ? (int)value.u.i : AT_DEFAULT_TIMEOUT;
+
+        cmd->retry = policy;
+        parse_retry_policy(table, "retry", &cmd->retry);
+
+        cmd->if_firmware = parse_string_list(table, "if_firmware");
+        cmd->unless_firmware = parse_string_list(table, "unless_firmware");
+        if (cmd->if_firmware || cmd->unless_firmware)
+            firmware_query_needed = TRUE;
+
+        if (!cmd->cmd)
+            g_error("AT command #%d lacks a `cmd` element", i);
+        if (cmd->basic && cmd->subcmd)
+            g_error("Basic AT command #%d can't have a `subcmd` element", i);
+        build_command_lines(cmd);
+    }
+}
+
+static void queue_init(struct AtQueue *queue, guint size)
+{
+    queue->size = MAX(size, 1);
+    queue->entries = g_new0(struct AtQueueEntry, queue->size);
+}
+
+static void free_commands_list(GArray *cmds)
+{
+    for (guint i = 0; i < cmds->len; i++) {
+        struct AtCommand *cmd = &g_array_index(cmds, struct AtCommand, i);
+
+        g_free(cmd->cmd);
+        g_free(cmd->subcmd);
+        g_free(cmd->value);
+        g_free(cmd->expected);
+        if (cmd->expected_fields)
+            g_array_unref(cmd->expected_fields);
+        g_free(cmd->query.data);
+        g_free(cmd->set_value.data);
+        g_free(cmd->set_expected.data);
+        g_strfreev(cmd->if_firmware);
+        g_strfreev(cmd->unless_firmware);
     }
+    g_array_free(cmds, TRUE);
 }
 
 int at_init(struct EG25Manager *manager, toml_table_t *config)
 {
-    toml_array_t *commands;
+    g_auto(GStrv) usb_ports = NULL;
     toml_datum_t uart_port;
+    int ret;
 
     uart_port = toml_string_in(config, "uart");
     if (!uart_port.ok)
         g_error("Configuration file lacks UART port definition");
 
-    manager->at_fd = configure_serial(uart_port.u.s);
-    if (manager->at_fd < 0) {
-        g_critical("Unable to configure %s", uart_port.u.s);
-        free(uart_port.u.s);
-        return 1;
+    at_trace_init(config);
+
+    // USB ports come first, in order of preference, the UART is added last
+    at_ports = g_array_new(FALSE, TRUE, sizeof(struct AtPort));
+    usb_ports = parse_string_list(config, "usb");
+    for (guint i = 0; usb_ports && usb_ports[i]; i++) {
+        struct AtPort usb = { 0 };
+
+        usb.path = g_strdup(usb_ports[i]);
+        usb.usb = TRUE;
+        usb.fd = -1;
+        g_array_append_val(at_ports, usb);
     }
+
+    ret = at_init_port(manager, config, uart_port.u.s);
     free(uart_port.u.s);
 
-    manager->at_source = g_unix_fd_add(manager->at_fd, G_IO_IN, modem_response, manager);
+    if (ret == 0)
+        at_liveness_init(manager, config);
+
+    return ret;
+}
+
+int at_init_port(struct EG25Manager *manager, toml_table_t *config, const char *port)
+{
+    toml_datum_t batch, echo, numeric, baudrate;
+    toml_table_t *wake;
+    g_autofree gchar *config_hash = NULL;
+    gboolean firmware_configured = FALSE;
+
+    struct AtPort uart = { 0 };
+
+    if (!at_ports)
+        at_ports = g_array_new(FALSE, TRUE, sizeof(struct AtPort));
+    uart.path = g_strdup(port);
+    uart.fd = -1;
+    g_array_append_val(at_ports, uart);
+
+    rx_line = g_string_sized_new(AT_RX_BUFFER_SIZE);
+    rx_response = g_string_sized_new(AT_RX_BUFFER_SIZE);
+
+    if (!transport_select(manager)) {
+        g_critical("Unable to configure %s", port);
+        return 1;
+    }
+
+    at_urc_subscribe("RDY", modem_ready, NULL);
+
+    batch = toml_bool_in(config, "batch");
+    if (batch.ok)
+        batch_enabled = batch.u.b;
+
+    baudrate = toml_int_in(config, "baudrate");
+    if (baudrate.ok && baudrate.u.i != AT_DEFAULT_BAUDRATE) {
+        if (baudrate_to_speed(baudrate.u.i) == B0) {
+            g_warning("Unsupported UART rate %" G_GINT64_FORMAT ", ignoring", baudrate.u.i);
+        } else {
+            target_baudrate = baudrate.u.i;
+
+            probe_command.basic = TRUE;
+            probe_command.cmd = g_strdup("");
+            probe_command.timeout = AT_PROBE_TIMEOUT;
+            probe_command.retry = (struct AtRetryPolicy){ .retries = 3, .backoff = 1.0 };
+            probe_command.callback = baudrate_probed;
+            probe_command.retry_callback = baudrate_probe_retry;
+            probe_command.abort_callback = baudrate_failed;
+            build_command_lines(&probe_command);
+
+            ipr_command.cmd = g_strdup("IPR");
+            ipr_command.value = g_strdup_printf("%u", target_baudrate);
+            ipr_command.timeout = AT_DEFAULT_TIMEOUT;
+            ipr_command.retry = default_retry_policy;
+            ipr_command.callback = baudrate_switched;
+            ipr_command.abort_callback = baudrate_failed;
+            build_command_lines(&ipr_command);
+        }
+    }
+
+    wake = toml_table_in(config, "wake");
+    if (wake) {
+        toml_datum_t value = toml_int_in(wake, "delay");
+
+        if (value.ok && value.u.i >= 0)
+            // The command times out if not answered in time, wake-up delay included
+            wake_delay = (guint)MIN(value.u.i, AT_DEFAULT_TIMEOUT / 2);
+
+        value = toml_int_in(wake, "idle");
+        if (value.ok && value.u.i >= 0)
+            wake_idle = (guint)MIN(value.u.i, G_MAXINT);
+    }
+
+    echo = toml_bool_in(config, "echo");
+    numeric = toml_bool_in(config, "numeric");
+    session_numeric = numeric.ok && numeric.u.b;
+    if ((echo.ok && !echo.u.b) || session_numeric) {
+        session_command.basic = TRUE;
+        session_command.cmd = g_strdup_printf("%s%s",
+                                              echo.ok && !echo.u.b ? "E0" : "",
+                                              session_numeric ? "V0" : "");
+        session_command.timeout = AT_DEFAULT_TIMEOUT;
+        session_command.retry = default_retry_policy;
+        parse_retry_policy(config, "retry", &session_command.retry);
+        build_command_lines(&session_command);
+    }
+
+    parse_commands_list(config, "configure", &configure_commands);
+
+    config_hash = hash_commands_list(configure_commands);
+    cache_enabled = at_cache_init(config, config_hash);
+
+    for (guint i = 0; i < configure_commands->len; i++) {
+        struct AtCommand *cmd = &g_array_index(configure_commands, struct AtCommand, i);
+
+        /*
+         * Only commands with a predictable response can be chained: queries
+         * answered by a prefixed line, and plain set commands
+         */
+        cmd->batch = batch_enabled && !cmd->basic && (cmd->expected || cmd->value);
+        if (strcmp(cmd->cmd, "QGMR") == 0 && !cmd->value && !cmd->expected) {
+            cmd->callback = store_firmware;
+            if (i > 0)
+                g_warning("QGMR isn't the first configure command, firmware conditions won't apply to earlier commands");
+            firmware_configured = TRUE;
+        }
+    }
+
+    imei_command.cmd = g_strdup("GSN");
+    imei_command.timeout = AT_DEFAULT_TIMEOUT;
+    imei_command.retry = default_retry_policy;
+    parse_retry_policy(config, "retry", &imei_command.retry);
+    imei_command.callback = store_imei;
+    build_command_lines(&imei_command);
+
+    parse_commands_list(config, "suspend", &suspend_commands);
 
-    commands = toml_array_in(config, "configure");
-    if (!commands)
-        g_error("Configuration file lacks initial AT commands list");
-    parse_commands_list(commands, &configure_commands);
+    parse_commands_list(config, "resume", &resume_commands);
 
-    commands = toml_array_in(config, "suspend");
-    if (!commands)
-        g_error("Configuration file lacks suspend AT commands list");
-    parse_commands_list(commands, &suspend_commands);
+    parse_commands_list(config, "reset", &reset_commands);
 
-    commands = toml_array_in(config, "resume");
-    if (!commands)
-        g_error("Configuration file lacks resume AT commands list");
-    parse_commands_list(commands, &resume_commands);
+    // Only query the firmware ourselves if it isn't part of the configure sequence
+    if (firmware_configured)
+        firmware_query_needed = FALSE;
+    if (firmware_query_needed) {
+        firmware_command.cmd = g_strdup("QGMR");
+        firmware_command.timeout = AT_DEFAULT_TIMEOUT;
+        firmware_command.retry = default_retry_policy;
+        parse_retry_policy(config, "retry", &firmware_command.retry);
+        firmware_command.callback = store_firmware;
+        build_command_lines(&firmware_command);
+    }
 
-    commands = toml_array_in(config, "reset");
-    if (!commands)
-        g_error("Configuration file lacks reset AT commands list");
-    parse_commands_list(commands, &reset_commands);
+    // Leave enough room for each sequence to be queued twice
+    queue_init(&at_queues[AT_PRIORITY_RESET], 2 * reset_commands->len);
+    queue_init(&at_queues[AT_PRIORITY_SUSPEND], 2 * suspend_commands->len);
+    queue_init(&at_queues[AT_PRIORITY_RESUME], 2 * resume_commands->len);
+    queue_init(&at_queues[AT_PRIORITY_CONFIGURE], 2 * (configure_commands->len + 6));
+    queue_init(&at_queues[AT_PRIORITY_ADHOC], AT_ADHOC_QUEUE_SIZE);
 
     return 0;
 }
 
 void at_destroy(struct EG25Manager *manager)
 {
-    g_source_remove(manager->at_source);
-    if (manager->at_fd > 0)
-        close(manager->at_fd);
+    at_liveness_destroy();
+    cancel_at_timers(manager);
+    if (wake_release_timer) {
+        g_source_remove(wake_release_timer);
+        wake_release_timer = 0;
+    }
+    if (wake_held)
+        wake_release(manager);
+    if (at_ports) {
+        for (guint i = 0; i < at_ports->len; i++) {
+            struct AtPort *port = &g_array_index(at_ports, struct AtPort, i);
+
+            port_close(manager, port);
+            g_free(port->path);
+        }
+        g_array_free(at_ports, TRUE);
+        at_ports = NULL;
+    }
+
+    if (rx_line)
+        g_string_free(rx_line, TRUE);
+    if (rx_response)
+        g_string_free(rx_response, TRUE);
+
+    if (urc_handlers) {
+        for (guint i = 0; i < urc_handlers->len; i++)
+            g_free(g_array_index(urc_handlers, struct AtUrcHandler, i).prefix);
+        g_array_free(urc_handlers, TRUE);
+        urc_handlers = NULL;
+    }
+
+    free_commands_list(configure_commands);
+    free_commands_list(suspend_commands);
+    free_commands_list(resume_commands);
+    free_commands_list(reset_commands);
+    g_free(imei_command.cmd);
+    g_free(imei_command.query.data);
+    g_clear_pointer(&firmware_command.cmd, g_free);
+    g_clear_pointer(&firmware_command.query.data, g_free);
+    firmware_query_needed = FALSE;
+    g_clear_pointer(&session_command.cmd, g_free);
+    g_clear_pointer(&session_command.query.data, g_free);
+    g_clear_pointer(&probe_command.cmd, g_free);
+    g_clear_pointer(&probe_command.query.data, g_free);
+    g_clear_pointer(&ipr_command.cmd, g_free);
+    g_clear_pointer(&ipr_command.value, g_free);
+    g_clear_pointer(&ipr_command.query.data, g_free);
+    g_clear_pointer(&ipr_command.set_value.data, g_free);
+    uart_baudrate = target_baudrate = AT_DEFAULT_BAUDRATE;
+    baud_verified = baud_failed = FALSE;
+    wake_delay = AT_WAKE_DELAY;
+    wake_idle = AT_WAKE_IDLE;
+    wake_time = 0;
+    session_numeric = FALSE;
+    rx_numeric = FALSE;
+
+    for (guint i = 0; i < AT_PRIORITY_COUNT; i++) {
+        queue_cancel(&at_queues[i], 0);
+        g_free(at_queues[i].entries);
+        memset(&at_queues[i], 0, sizeof(at_queues[i]));
+    }
+    at_current = NULL;
+
+    // No new request can be queued from the callbacks at this point
+    if (cancelled_requests_source) {
+        g_source_remove(cancelled_requests_source);
+        request_flush_cancelled(NULL);
+    }
+
+    at_cache_destroy();
+    at_trace_destroy();
+    g_clear_pointer(&manager->modem_firmware, g_free);
+    g_clear_pointer(&manager->modem_imei, g_free);
+}
+
+void at_urc_subscribe(const char *prefix, AtUrcCallback callback, gpointer user_data)
+{
+    struct AtUrcHandler handler;
+
+    if (!urc_handlers)
+        urc_handlers = g_array_new(FALSE, TRUE, sizeof(struct AtUrcHandler));
+
+    handler.prefix = g_strdup(prefix);
+    handler.callback = callback;
+    handler.user_data = user_data;
+    g_array_append_val(urc_handlers, handler);
+}
+
+void at_urc_unsubscribe(const char *prefix, AtUrcCallback callback, gpointer user_data)
+{
+    if (!urc_handlers)
+        return;
+
+    for (guint i = 0; i < urc_handlers->len; i++) {
+        struct AtUrcHandler *handler = &g_array_index(urc_handlers, struct AtUrcHandler, i);
+
+        if (strcmp(handler->prefix, prefix) == 0 &&
+            handler->callback == callback &&
+            handler->user_data == user_data) {
+            g_free(handler->prefix);
+            g_array_remove_index(urc_handlers, i);
+            return;
+        }
+    }
+}
+
+gboolean at_is_idle(struct EG25Manager *manager)
+{
+    if (at_command_pending(manager))
+        return FALSE;
+
+    for (enum AtPriority prio = 0; prio < AT_PRIORITY_COUNT; prio++) {
+        if (at_queues[prio].len > 0)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+gboolean at_wake_latency(guint *last, guint *average)
+{
+    if (!wake_latency_count)
+        return FALSE;
+
+    *last = wake_latency_last;
+    *average = wake_latency_total / wake_latency_count;
+
+    return TRUE;
+}
+
+gboolean at_request_async(struct EG25Manager *manager,
+                          const char         *cmd,
+                          int                 timeout,
+                          AtRequestCallback   callback,
+                          gpointer            user_data)
+{
+    struct AtQueue *queue = &at_queues[AT_PRIORITY_ADHOC];
+    struct AtRequest *request;
+    const char *name;
+    gsize len = strlen(cmd);
+
+    if (!queue->entries) {
+        g_warning("AT commands not initialized, can't send request %s", cmd);
+        return FALSE;
+    }
+
+    if (len + 4 > AT_COMMAND_MAX_LENGTH || strpbrk(cmd, "\r\n")) {
+        g_warning("Invalid AT request [%s]", cmd);
+        return FALSE;
+    }
+
+    // The command name is used to tell its response from URCs
+    name = cmd[0] == '+' ? cmd + 1 : cmd;
+
+    request = g_new0(struct AtRequest, 1);
+    request->manager = manager;
+    request->callback = callback;
+    request->user_data = user_data;
+    request->command.cmd = len ? g_strndup(name, strcspn(name, "=?")) : g_strdup("AT");
+    request->command.query.data = g_strdup_printf("AT%s\r\n", cmd);
+    request->command.query.len = len + 4;
+    request->command.timeout = timeout > 0 ? timeout : AT_DEFAULT_TIMEOUT;
+
+    if (!queue_push(queue, &request->command)) {
+        request->callback = NULL;
+        request_finish(request, NULL, NULL);
+        return FALSE;
+    }
+    queue_peek(queue, queue->len - 1)->request = request;
+
+    // Don't interfere with the command being processed, if any
+    if (!at_command_pending(manager))
+        send_at_command(manager);
+
+    return TRUE;
+}
+
+GStrv at_response_fields(const char *response, const char *prefix)
+{
+    g_auto(GStrv) lines = g_strsplit(response, "\r\n", -1);
+    gsize prefix_len = strlen(prefix);
+
+    for (guint i = 0; lines[i]; i++) {
+        g_autoptr(GArray) fields = NULL;
+        GStrv values;
+
+        if (!g_str_has_prefix(lines[i], prefix))
+            continue;
+
+        fields = parse_fields(lines[i] + prefix_len, strlen(lines[i]) - prefix_len);
+        if (!fields)
+            return NULL;
+
+        values = g_new0(gchar *, fields->len + 1);
+        for (guint j = 0; j < fields->len; j++)
+            values[j] = g_strdup(g_array_index(fields, struct AtField, j).value);
+
+        return values;
+    }
+
+    return NULL;
+}
+
+static void queue_sequence(struct EG25Manager *manager,
+                           enum AtPriority     priority,
+                           GArray             *cmds)
+{
+    for (guint i = 0; i < cmds->len; i++)
+        queue_push(&at_queues[priority], &g_array_index(cmds, struct AtCommand, i));
 
-    g_array_free(configure_commands, TRUE);
-    g_array_free(suspend_commands, TRUE);
-    g_array_free(resume_commands, TRUE);
-    g_array_free(reset_commands, TRUE);
+    // Don't interfere with the command being processed, if any
+    if (!at_command_pending(manager))
+        send_at_command(manager);
 }
 
 void at_sequence_configure(struct EG25Manager *manager)
 {
-    for (guint i = 0; i < configure_commands->len; i++) {
-        struct AtCommand *cmd = &g_array_index(configure_commands, struct AtCommand, i);
-        append_at_command(manager, cmd->cmd, cmd->subcmd, cmd->value, cmd->expected);
+    g_clear_pointer(&manager->modem_firmware, g_free);
+    g_clear_pointer(&manager->modem_imei, g_free);
+
+    // Start over if the modem was already being configured
+    cancel_sequence(manager, AT_PRIORITY_CONFIGURE);
+    at_trace_sequence(manager, AT_TRACE_CONFIGURE);
+    if (target_baudrate != AT_DEFAULT_BAUDRATE) {
+        // Probe, switch to the target rate, then probe again to verify it
+        baud_failed = FALSE;
+        queue_push(&at_queues[AT_PRIORITY_CONFIGURE], &probe_command);
+        queue_push(&at_queues[AT_PRIORITY_CONFIGURE], &ipr_command);
+        queue_push(&at_queues[AT_PRIORITY_CONFIGURE], &probe_command);
     }
-    send_at_command(manager);
+    if (session_command.cmd)
+        queue_push(&at_queues[AT_PRIORITY_CONFIGURE], &session_command);
+    if (cache_enabled)
+        queue_push(&at_queues[AT_PRIORITY_CONFIGURE], &imei_command);
+    if (firmware_query_needed)
+        queue_push(&at_queues[AT_PRIORITY_CONFIGURE], &firmware_command);
+
+    queue_sequence(manager, AT_PRIORITY_CONFIGURE, configure_commands);
 }
 
 void at_sequence_suspend(struct EG25Manager *manager)
 {
-    for (guint i = 0; i < suspend_commands->len; i++) {
-        struct AtCommand *cmd = &g_array_index(suspend_commands, struct AtCommand, i);
-        append_at_command(manager, cmd->cmd, cmd->subcmd, cmd->value, cmd->expected);
-    }
-    send_at_command(manager);
+    cancel_sequence(manager, AT_PRIORITY_RESUME);
+    at_trace_sequence(manager, AT_TRACE_SUSPEND);
+    queue_sequence(manager, AT_PRIORITY_SUSPEND, suspend_commands);
 }
 
 void at_sequence_resume(struct EG25Manager *manager)
 {
-    for (guint i = 0; i < resume_commands->len; i++) {
-        struct AtCommand *cmd = &g_array_index(resume_commands, struct AtCommand, i);
-        append_at_command(manager, cmd->cmd, cmd->subcmd, cmd->value, cmd->expected);
-    }
-    send_at_command(manager);
+    cancel_sequence(manager, AT_PRIORITY_SUSPEND);
+    at_trace_sequence(manager, AT_TRACE_RESUME);
+    queue_sequence(manager, AT_PRIORITY_RESUME, resume_commands);
 }
 
 void at_sequence_reset(struct EG25Manager *manager)
 {
-    for (guint i = 0; i < reset_commands->len; i++) {
-        struct AtCommand *cmd = &g_array_index(reset_commands, struct AtCommand, i);
-        append_at_command(manager, cmd->cmd, cmd->subcmd, cmd->value, cmd->expected);
-    }
-    send_at_command(manager);
+    /*
+     * The modem is about to reboot, so only keep the suspend sequence as we
+     * still need it to complete in order to release the sleep inhibitor
+     */
+    for (enum AtPriority prio = AT_PRIORITY_RESUME; prio < AT_PRIORITY_COUNT; prio++)
+        cancel_sequence(manager, prio);
+
+    at_trace_sequence(manager, AT_TRACE_RESET);
+    queue_sequence(manager, AT_PRIORITY_RESET, reset_commands);
 }
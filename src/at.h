@@ -8,9 +8,64 @@
 
 #include "manager.h"
 
+/*
+ * Called for each unsolicited result code starting with the subscribed
+ * prefix; handlers must not (un)subscribe from within the callback.
+ */
+typedef void (*AtUrcCallback)(struct EG25Manager *manager,
+                              const char         *urc,
+                              gpointer            user_data);
+
+/*
+ * Called once a request queued with at_request_async() completes. On success
+ * `error` is NULL and `response` holds the information lines of the response
+ * (without the command echo and final result code, possibly empty). On
+ * failure `response` is NULL and `error` is the final result code (e.g.
+ * "+CME ERROR: 10"), "TIMEOUT" if the modem didn't answer, or "CANCELLED" if
+ * the request was dropped (e.g. because the modem is being reset).
+ */
+typedef void (*AtRequestCallback)(struct EG25Manager *manager,
+                                  const char         *response,
+                                  const char         *error,
+                                  gpointer            user_data);
+
 int at_init(struct EG25Manager *data, toml_table_t *config);
+/*
+ * Same as at_init(), but using `port` instead of the configured UART and
+ * without recording any trace
+ */
+int at_init_port(struct EG25Manager *data, toml_table_t *config, const char *port);
 void at_destroy(struct EG25Manager *data);
 
+void at_urc_subscribe(const char *prefix, AtUrcCallback callback, gpointer user_data);
+void at_urc_unsubscribe(const char *prefix, AtUrcCallback callback, gpointer user_data);
+
+// Whether no command is being processed or waiting to be sent
+gboolean at_is_idle(struct EG25Manager *data);
+/*
+ * Time (in ms) the modem took to answer after being woken up through DTR, for
+ * the last wake-up and on average; returns FALSE if it was never woken up
+ */
+gboolean at_wake_latency(guint *last, guint *average);
+
+/*
+ * Queue `cmd` (the command line without its "AT" prefix, e.g. "+CSQ",
+ * "+QGPSLOC=2" or "" for a bare "AT") after the configured sequences, waiting
+ * `timeout` ms for an answer (or the default timeout if 0); the request isn't
+ * retried on failure. Returns FALSE if the request couldn't be queued, in
+ * which case `callback` won't be called.
+ */
+gboolean at_request_async(struct EG25Manager *data,
+                          const char         *cmd,
+                          int                 timeout,
+                          AtRequestCallback   callback,
+                          gpointer            user_data);
+/*
+ * Parse the fields of the first line of `response` starting with `prefix`
+ * (e.g. "+CSQ:"), without their quotes; returns NULL if there's no such line
+ */
+GStrv at_response_fields(const char *response, const char *prefix);
+
 void at_sequence_configure(struct EG25Manager *data);
 void at_sequence_suspend(struct EG25Manager *data);
 void at_sequence_resume(struct EG25Manager *data);
@@ -0,0 +1,569 @@
+/*
+ * Copyright (C) 2020 Arnaud Ferraris <arnaud.ferraris@gmail.com>
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/*
+ * Minimal EG25 modem simulator, exposing its AT interface on a pseudo-terminal
+ * so eg25-manager can be tested without the actual hardware: point the
+ * `[at].uart` configuration key to the path given with `--link`.
+ *
+ * It emulates:
+ *   - the boot sequence (RDY followed by a few status URCs), on startup and
+ *     after each reset (AT+CFUN=1,1)
+ *   - echo (ATE) and numeric result codes (ATV)
+ *   - query/set semantics for all extended commands, including those taking a
+ *     setting name as first argument (QCFG and QURCCFG); settings are kept
+ *     across resets, as they are in the modem's NV memory
+ *   - chained commands (e.g. "AT+QDAI?;+QCFG=\"ims\"")
+ *
+ * Each command gets answered after a configurable latency, and ERRORs or URC
+ * bursts can be injected. All commands are logged with the time elapsed since
+ * the last boot, which can be used to measure eg25-manager's sequences.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <glib-unix.h>
+
+#define SIM_FIRMWARE "EG25GGBR07A08M2G_01.003.01.003"
+#define SIM_IMEI "869710030002905"
+
+struct Simulator {
+    GMainLoop *loop;
+    int master_fd;
+    int slave_fd;
+    guint master_source;
+    GString *input;
+
+    gboolean booted;
+    gboolean echo;
+    gboolean verbose;
+    guint boot_timer;
+    gint64 boot_time;
+
+    guint response_timer;
+    GString *response;
+
+    guint urc_timer;
+    guint urc_count;
+
+    GHashTable *settings;
+    GHashTable *latencies;
+    GHashTable *errors;
+};
+
+// Command-line options
+static gchar *link_path = NULL;
+static gint boot_delay = 1000;
+static gint latency = 20;
+static gchar **latency_cmds = NULL;
+static gint error_rate = 0;
+static gchar **error_cmds = NULL;
+static gint urc_interval = 0;
+static gint urc_burst = 5;
+
+/*
+ * Factory settings: those don't match the ones from the configuration files,
+ * so eg25-manager has to change them on first run
+ */
+static const struct {
+    const char *key;
+    const char *value;
+} default_settings[] = {
+    { "QDAI", "1,1,0,1,0,0,1,0" },
+    { "QCFG=\"risignaltype\"", "\"respective\"" },
+    { "QCFG=\"ims\"", "0" },
+    { "QCFG=\"apready\"", "0,0,500" },
+    { "QCFG=\"urc/cache\"", "0" },
+    { "QURCCFG=\"urcport\"", "\"usbat\"" },
+    { "QGPS", "0" },
+    { "QSCLK", "0" },
+    { "IPR", "115200" },
+};
+
+static const char *boot_urcs[] = {
+    "RDY",
+    "+CFUN: 1",
+    "+CPIN: READY",
+    "+QUSIM: 1",
+    "+QIND: SMS DONE",
+};
+
+static const char *burst_urcs[] = {
+    "+QIND: \"csq\",22,99",
+    "+CREG: 1",
+    "+QGPSURC: \"xtradata\",0",
+    "+CTZV: +04,0",
+};
+
+static gint64 elapsed_ms(struct Simulator *sim)
+{
+    return (g_get_monotonic_time() - sim->boot_time) / 1000;
+}
+
+static void sim_write(struct Simulator *sim, const char *data, gsize len)
+{
+    if (write(sim->master_fd, data, len) < (ssize_t)len)
+        g_warning("Couldn't write %zu bytes: %s", len, g_strerror(errno));
+}
+
+static void append_info(struct Simulator *sim, GString *response, const char *info)
+{
+    if (sim->verbose)
+        g_string_append_printf(response, "\r\n%s\r\n", info);
+    else
+        g_string_append_printf(response, "%s\r\n", info);
+}
+
+/*
+ * Final result codes, either in verbose or numeric form (ATV)
+ */
+static void append_result(struct Simulator *sim, GString *response, gboolean ok, const char *error)
+{
+    if (error)
+        append_info(sim, response, error);
+    else if (sim->verbose)
+        g_string_append(response, ok ? "\r\nOK\r\n" : "\r\nERROR\r\n");
+    else
+        g_string_append(response, ok ? "0\r" : "4\r");
+}
+
+static void send_urcs(struct Simulator *sim, const char **urcs, guint count)
+{
+    g_autoptr(GString) data = g_string_new(NULL);
+
+    for (guint i = 0; i < count; i++)
+        g_string_append_printf(data, "\r\n%s\r\n", urcs[i]);
+
+    sim_write(sim, data->str, data->len);
+}
+
+static gboolean sim_boot_done(struct Simulator *sim)
+{
+    sim->boot_timer = 0;
+    sim->booted = TRUE;
+    sim->boot_time = g_get_monotonic_time();
+
+    g_message("Modem ready");
+    send_urcs(sim, boot_urcs, G_N_ELEMENTS(boot_urcs));
+
+    return G_SOURCE_REMOVE;
+}
+
+static void sim_boot(struct Simulator *sim)
+{
+    // Echo and result code format aren't stored in NV memory
+    sim->booted = FALSE;
+    sim->echo = TRUE;
+    sim->verbose = TRUE;
+    g_string_truncate(sim->input, 0);
+
+    if (sim->response_timer) {
+        g_source_remove(sim->response_timer);
+        sim->response_timer = 0;
+    }
+
+    g_message("Booting modem...");
+    sim->boot_timer = g_timeout_add(boot_delay, G_SOURCE_FUNC(sim_boot_done), sim);
+}
+
+static gboolean sim_send_burst(struct Simulator *sim)
+{
+    g_autoptr(GPtrArray) urcs = g_ptr_array_new();
+
+    if (!sim->booted)
+        return G_SOURCE_CONTINUE;
+
+    for (gint i = 0; i < urc_burst; i++)
+        g_ptr_array_add(urcs, (gpointer)burst_urcs[sim->urc_count++ % G_N_ELEMENTS(burst_urcs)]);
+
+    g_message("[+%" G_GINT64_FORMAT " ms] Sending %d URCs", elapsed_ms(sim), urc_burst);
+    send_urcs(sim, (const char **)urcs->pdata, urcs->len);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/*
+ * Execute a single extended command (without the leading '+'), returning
+ * FALSE on error; `error` can be set to a specific error code
+ */
+static gboolean run_extended(struct Simulator *sim,
+                             const char       *command,
+                             GString          *response,
+                             const char      **error,
+                             gboolean         *reset)
+{
+    g_autofree gchar *name = NULL;
+    g_autofree gchar *info = NULL;
+    const char *args = NULL;
+    const char *value;
+    gsize len = strcspn(command, "?=");
+
+    name = g_ascii_strup(command, len);
+    if (command[len] == '=')
+        args = &command[len + 1];
+
+    if (g_hash_table_contains(sim->errors, name)) {
+        *error = g_hash_table_lookup(sim->errors, name);
+        return FALSE;
+    }
+
+    // Test command: we don't have the supported ranges, so just accept it
+    if (args && strcmp(args, "?") == 0)
+        return TRUE;
+
+    if (command[len] == '?') {
+        value = g_hash_table_lookup(sim->settings, name);
+        if (!value)
+            return FALSE;
+
+        info = g_strdup_printf("+%s: %s", name, value);
+        append_info(sim, response, info);
+        return TRUE;
+    }
+
+    if (!args) {
+        // Execution commands
+        if (strcmp(name, "QGMR") == 0 || strcmp(name, "GMR") == 0) {
+            append_info(sim, response, SIM_FIRMWARE);
+        } else if (strcmp(name, "GSN") == 0 || strcmp(name, "CGSN") == 0) {
+            append_info(sim, response, SIM_IMEI);
+        } else if (strcmp(name, "QGPSEND") == 0) {
+            if (g_strcmp0(g_hash_table_lookup(sim->settings, "QGPS"), "1") != 0) {
+                *error = "+CME ERROR: 505";
+                return FALSE;
+            }
+            g_hash_table_insert(sim->settings, g_strdup("QGPS"), g_strdup("0"));
+        } else if (strcmp(name, "QPOWD") == 0) {
+            append_info(sim, response, "POWERED DOWN");
+        }
+        return TRUE;
+    }
+
+    if (strcmp(name, "QCFG") == 0 || strcmp(name, "QURCCFG") == 0) {
+        // First argument is the setting name, e.g. QCFG="ims",1
+        g_autofree gchar *key = NULL;
+        const char *sep;
+
+        if (args[0] != '"' || !(sep = strchr(args + 1, '"')))
+            return FALSE;
+
+        key = g_strdup_printf("%s=%.*s", name, (int)(sep - args + 1), args);
+        if (sep[1] == '\0') {
+            value = g_hash_table_lookup(sim->settings, key);
+            if (!value)
+                return FALSE;
+
+            // The modem also reports whether VoLTE is active, which it never is here
+            if (strcmp(key, "QCFG=\"ims\"") == 0)
+                info = g_strdup_printf("+%s: %s,%s,0", name, args, value);
+            else
+                info = g_strdup_printf("+%s: %s,%s", name, args, value);
+            append_info(sim, response, info);
+        } else if (sep[1] == ',') {
+            g_hash_table_insert(sim->settings, g_steal_pointer(&key), g_strdup(&sep[2]));
+        } else {
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    if (strcmp(name, "CFUN") == 0 && strcmp(args, "1,1") == 0)
+        *reset = TRUE;
+    else
+        g_hash_table_insert(sim->settings, g_steal_pointer(&name), g_strdup(args));
+
+    return TRUE;
+}
+
+/*
+ * Execute basic commands (e.g. "E0V1"), returning FALSE on error
+ */
+static gboolean run_basic(struct Simulator *sim, const char *commands)
+{
+    const char *cmd = commands;
+
+    while (*cmd) {
+        char letter = g_ascii_toupper(*cmd++);
+        int value = 0;
+
+        if (letter == '&')
+            letter = g_ascii_toupper(*cmd++);
+        while (g_ascii_isdigit(*cmd))
+            value = value * 10 + (*cmd++ - '0');
+
+        switch (letter) {
+        case 'E':
+            sim->echo = value;
+            break;
+        case 'V':
+            sim->verbose = value;
+            break;
+        case 'F':
+        case 'Q':
+        case 'W':
+        case 'Z':
+            break;
+        default:
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean sim_process_input(struct Simulator *sim);
+
+static gboolean sim_send_response(struct Simulator *sim)
+{
+    sim_write(sim, sim->response->str, sim->response->len);
+    g_string_truncate(sim->response, 0);
+    sim->response_timer = 0;
+
+    // Commands may have been received in the meantime
+    sim_process_input(sim);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean sim_reset(struct Simulator *sim)
+{
+    sim_send_response(sim);
+    sim_boot(sim);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Execute a full command line, then send the response once the configured
+ * latency has elapsed
+ */
+static void sim_process_line(struct Simulator *sim, const char *line)
+{
+    g_auto(GStrv) commands = NULL;
+    const char *error = NULL;
+    gboolean reset = FALSE;
+    gboolean ok = TRUE;
+    guint delay = 0;
+
+    g_message("[+%" G_GINT64_FORMAT " ms] %s", elapsed_ms(sim), line);
+
+    if (g_ascii_strncasecmp(line, "AT", 2) != 0)
+        return;
+
+    commands = g_strsplit(line + 2, ";", -1);
+    for (guint i = 0; commands[i] && ok; i++) {
+        const char *cmd = commands[i];
+        gsize len = strcspn(cmd, "?=");
+        g_autofree gchar *name = g_ascii_strup(cmd + (cmd[0] == '+'), len - (cmd[0] == '+'));
+        gpointer cmd_latency;
+
+        if (g_hash_table_lookup_extended(sim->latencies, name, NULL, &cmd_latency))
+            delay += GPOINTER_TO_UINT(cmd_latency);
+        else
+            delay += latency;
+
+        if (cmd[0] == '+')
+            ok = run_extended(sim, cmd + 1, sim->response, &error, &reset);
+        else
+            ok = run_basic(sim, cmd);
+    }
+
+    if (ok && error_rate > 0 && g_random_int_range(0, 100) < error_rate) {
+        g_message("Injecting error");
+        g_string_truncate(sim->response, 0);
+        ok = FALSE;
+    }
+
+    append_result(sim, sim->response, ok, ok ? NULL : error);
+
+    if (reset)
+        sim->response_timer = g_timeout_add(delay, G_SOURCE_FUNC(sim_reset), sim);
+    else
+        sim->response_timer = g_timeout_add(delay, G_SOURCE_FUNC(sim_send_response), sim);
+}
+
+/*
+ * Process pending input, one command line at a time: the next line is only
+ * processed once the response to the previous one has been sent
+ */
+static gboolean sim_process_input(struct Simulator *sim)
+{
+    while (sim->booted && !sim->response_timer) {
+        g_autofree gchar *line = NULL;
+        gsize len = strcspn(sim->input->str, "\r");
+
+        if (len == sim->input->len)
+            break;
+
+        line = g_strndup(sim->input->str, len);
+        if (sim->echo)
+            sim_write(sim, sim->input->str, len + 1);
+        g_string_erase(sim->input, 0, len + 1);
+
+        // Skip the LF following the previous command, if any
+        g_strstrip(line);
+        if (line[0])
+            sim_process_line(sim, line);
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean sim_receive(gint fd, GIOCondition event, gpointer data)
+{
+    struct Simulator *sim = data;
+    char buffer[256];
+    ssize_t ret;
+
+    while ((ret = read(fd, buffer, sizeof(buffer))) > 0) {
+        // The modem doesn't process anything until it's fully booted
+        if (sim->booted)
+            g_string_append_len(sim->input, buffer, ret);
+    }
+
+    sim_process_input(sim);
+
+    return TRUE;
+}
+
+static gboolean sim_quit(struct Simulator *sim)
+{
+    g_main_loop_quit(sim->loop);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Parse a list of "CMD=VALUE" strings into `table`, using `default_value` if
+ * VALUE is missing
+ */
+static void parse_cmd_list(GHashTable  *table,
+                           gchar      **list,
+                           gboolean     numeric,
+                           const char  *default_value)
+{
+    for (guint i = 0; list && list[i]; i++) {
+        g_auto(GStrv) parts = g_strsplit(list[i], "=", 2);
+        gchar *name = g_ascii_strup(parts[0], -1);
+        const char *value = parts[1] ? parts[1] : default_value;
+
+        if (numeric)
+            g_hash_table_insert(table, name, GUINT_TO_POINTER(atoi(value)));
+        else if (value)
+            g_hash_table_insert(table, name, g_strdup_printf("+CME ERROR: %s", value));
+        else
+            g_hash_table_insert(table, name, NULL);
+    }
+}
+
+static int open_pty(struct Simulator *sim)
+{
+    struct termios ttycfg;
+    const char *port;
+
+    sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (sim->master_fd < 0 || grantpt(sim->master_fd) < 0 || unlockpt(sim->master_fd) < 0)
+        return -1;
+
+    port = ptsname(sim->master_fd);
+
+    /*
+     * Keep the slave side open so the pseudo-terminal stays available when
+     * eg25-manager closes it, and make it raw until eg25-manager configures it
+     */
+    sim->slave_fd = open(port, O_RDWR | O_NOCTTY);
+    if (sim->slave_fd < 0)
+        return -1;
+
+    tcgetattr(sim->slave_fd, &ttycfg);
+    cfmakeraw(&ttycfg);
+    tcsetattr(sim->slave_fd, TCSANOW, &ttycfg);
+
+    if (link_path) {
+        unlink(link_path);
+        if (symlink(port, link_path) < 0)
+            return -1;
+        g_message("Modem available on %s (%s)", link_path, port);
+    } else {
+        g_message("Modem available on %s", port);
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    g_autoptr(GOptionContext) opt_context = NULL;
+    g_autoptr(GError) err = NULL;
+    struct Simulator sim;
+    const GOptionEntry options[] = {
+        { "link", 'l', 0, G_OPTION_ARG_FILENAME, &link_path, "Create a symlink to the AT port.", "PATH" },
+        { "boot-delay", 'b', 0, G_OPTION_ARG_INT, &boot_delay, "Boot time (ms).", "MS" },
+        { "latency", 't', 0, G_OPTION_ARG_INT, &latency, "Default command latency (ms).", "MS" },
+        { "latency-cmd", 'T', 0, G_OPTION_ARG_STRING_ARRAY, &latency_cmds, "Latency of a specific command.", "CMD=MS" },
+        { "error-rate", 'r', 0, G_OPTION_ARG_INT, &error_rate, "Percentage of commands answered with ERROR.", "PERCENT" },
+        { "error", 'e', 0, G_OPTION_ARG_STRING_ARRAY, &error_cmds, "Always fail a command (with a CME error code).", "CMD[=CODE]" },
+        { "urc-interval", 'u', 0, G_OPTION_ARG_INT, &urc_interval, "Send URC bursts periodically (ms).", "MS" },
+        { "urc-burst", 'n', 0, G_OPTION_ARG_INT, &urc_burst, "Number of URCs per burst.", "COUNT" },
+        { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
+    };
+
+    memset(&sim, 0, sizeof(sim));
+
+    opt_context = g_option_context_new ("- Quectel EG25 modem simulator");
+    g_option_context_add_main_entries (opt_context, options, NULL);
+    if (!g_option_context_parse (opt_context, &argc, &argv, &err)) {
+        g_warning ("%s", err->message);
+        return 1;
+    }
+
+    sim.settings = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    for (guint i = 0; i < G_N_ELEMENTS(default_settings); i++)
+        g_hash_table_insert(sim.settings, g_strdup(default_settings[i].key),
+                            g_strdup(default_settings[i].value));
+
+    sim.latencies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    parse_cmd_list(sim.latencies, latency_cmds, TRUE, "0");
+    sim.errors = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    parse_cmd_list(sim.errors, error_cmds, FALSE, NULL);
+
+    if (open_pty(&sim) < 0)
+        g_error("Unable to create pseudo-terminal: %s", g_strerror(errno));
+
+    sim.loop = g_main_loop_new(NULL, FALSE);
+    sim.input = g_string_new(NULL);
+    sim.response = g_string_new(NULL);
+    sim.master_source = g_unix_fd_add(sim.master_fd, G_IO_IN, sim_receive, &sim);
+    if (urc_interval > 0)
+        sim.urc_timer = g_timeout_add(urc_interval, G_SOURCE_FUNC(sim_send_burst), &sim);
+
+    g_unix_signal_add(SIGINT, G_SOURCE_FUNC(sim_quit), &sim);
+    g_unix_signal_add(SIGTERM, G_SOURCE_FUNC(sim_quit), &sim);
+
+    sim_boot(&sim);
+    g_main_loop_run(sim.loop);
+
+    if (link_path)
+        unlink(link_path);
+    close(sim.slave_fd);
+    close(sim.master_fd);
+    g_string_free(sim.input, TRUE);
+    g_string_free(sim.response, TRUE);
+    g_hash_table_destroy(sim.settings);
+    g_hash_table_destroy(sim.latencies);
+    g_hash_table_destroy(sim.errors);
+
+    return 0;
+}
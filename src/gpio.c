@@ -5,6 +5,9 @@
  */
 
 #include "gpio.h"
+#include "at-trace.h"
+
+#include <glib-unix.h>
 
 #define GPIO_CHIP1_LABEL "1c20800.pinctrl"
 #define GPIO_CHIP2_LABEL "1f02c00.pinctrl"
@@ -22,38 +25,175 @@ enum {
     GPIO_OUT_COUNT
 };
 
+#define GPIO_OUT_LINE(x) (1 << (x))
+
+/*
+ * Output lines are requested as one bulk per GPIO chip, so lines changing
+ * together (e.g. APREADY and DTR) are updated with a single ioctl; as a bulk
+ * can only be updated as a whole, the current value of each line is kept in
+ * `gpio_out_values`.
+ */
+static struct gpiod_line_bulk gpio_out_bulk[2];
+static guint gpio_out_chip[GPIO_OUT_COUNT];
+static int gpio_out_values[GPIO_OUT_COUNT];
 
 enum {
     GPIO_IN_STATUS = 0,
+    GPIO_IN_RI,
     GPIO_IN_COUNT
 };
 
+/*
+ * With QSCLK=1, the modem is allowed to sleep while DTR is high, i.e. once
+ * the suspend sequence has been executed; DTR can be temporarily pulled low
+ * in order to talk to it over the UART in the meantime.
+ */
+static gboolean dtr_sleep = FALSE;
+static gboolean dtr_woken = FALSE;
+
+// Watch for STATUS edge events, if those are supported
+static guint status_source = 0;
+
+/*
+ * RI is pulled low by the modem to signal an incoming call, SMS or other URC,
+ * for a duration set through QCFG "urc/ri/*" (120 ms unless configured
+ * otherwise): pulses are told apart by their width, in ms, using the
+ * configured [min, max] ranges, which must match those settings.
+ */
+static guint ri_source = 0;
+static gint64 ri_pulse_start = 0;
+static gint64 ri_ring_width[2] = { 100, 200 };
+static gint64 ri_sms_width[2] = { -1, -1 };
+
+// Default time (in ms) during which PWRKEY is asserted
+#define GPIO_PWRKEY_PULSE 1000
+
+// Set all output lines in `lines` (a mask of GPIO_OUT_LINE() values) to `value`
+static void gpio_set_outputs(struct EG25Manager *manager, guint lines, int value)
+{
+    gboolean changed[2] = { FALSE, FALSE };
+
+    for (int i = 0; i < GPIO_OUT_COUNT; i++) {
+        if (lines & GPIO_OUT_LINE(i)) {
+            gpio_out_values[i] = value;
+            changed[gpio_out_chip[i]] = TRUE;
+        }
+    }
+
+    for (guint chip = 0; chip < G_N_ELEMENTS(gpio_out_bulk); chip++) {
+        int values[GPIO_OUT_COUNT];
+        guint n = 0;
+
+        if (!changed[chip])
+            continue;
+
+        // Lines were added to the bulk in GPIO_OUT_* order
+        for (int i = 0; i < GPIO_OUT_COUNT; i++) {
+            if (gpio_out_chip[i] == chip)
+                values[n++] = gpio_out_values[i];
+        }
+
+        if (gpiod_line_set_value_bulk(&gpio_out_bulk[chip], values) < 0)
+            g_warning("Unable to set output GPIOs on chip %u", chip);
+    }
+}
+
+/*
+ * PWRKEY is pulsed from timers so the main loop keeps running meanwhile:
+ * the sequence optionally waits for the other lines to settle, then asserts
+ * PWRKEY for `pwrkey_pulse` ms before releasing it.
+ */
+enum GpioPowerStep {
+    GPIO_POWER_IDLE = 0,
+    GPIO_POWER_DELAY,
+    GPIO_POWER_PULSE,
+};
+
+static enum GpioPowerStep power_step = GPIO_POWER_IDLE;
+static guint power_timer = 0;
+static guint pwrkey_pulse = GPIO_PWRKEY_PULSE;
+
+static gboolean power_sequence_step(struct EG25Manager *manager)
+{
+    power_timer = 0;
+
+    switch (power_step) {
+    case GPIO_POWER_DELAY:
+        gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_PWRKEY), 1);
+        power_step = GPIO_POWER_PULSE;
+        power_timer = g_timeout_add(pwrkey_pulse, G_SOURCE_FUNC(power_sequence_step), manager);
+        break;
+    case GPIO_POWER_PULSE:
+        gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_PWRKEY), 0);
+        power_step = GPIO_POWER_IDLE;
+        g_message("Executed power-on/off sequence");
+        break;
+    default:
+        break;
+    }
+
+    return G_SOURCE_REMOVE;
+}
+
+// `delay` is in microseconds, as the `poweron_delay` setting
+static void power_sequence_start(struct EG25Manager *manager, gulong delay)
+{
+    // The modem would see a single, longer pulse anyway
+    if (power_step != GPIO_POWER_IDLE) {
+        g_message("Power-on/off sequence already in progress");
+        return;
+    }
+
+    power_step = GPIO_POWER_DELAY;
+    if (delay > 0)
+        power_timer = g_timeout_add((delay + 999) / 1000, G_SOURCE_FUNC(power_sequence_step), manager);
+    else
+        power_sequence_step(manager);
+}
+
 int gpio_sequence_poweron(struct EG25Manager *manager)
 {
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_PWRKEY], 1);
-    sleep(1);
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_PWRKEY], 0);
+    // Modem might crash on boot (especially with worn battery) if we don't delay here
+    power_sequence_start(manager, manager->poweron_delay);
 
-    g_message("Executed power-on/off sequence");
+    at_trace_gpio(manager, "poweron");
+    g_message("Started power-on sequence");
 
     return 0;
 }
 
 int gpio_sequence_shutdown(struct EG25Manager *manager)
 {
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_DISABLE], 1);
-    gpio_sequence_poweron(manager);
+    gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_DISABLE), 1);
+
+    // Shutting down takes over any pending power-on sequence
+    if (power_timer) {
+        g_source_remove(power_timer);
+        power_timer = 0;
+    }
+    if (power_step == GPIO_POWER_PULSE) {
+        // PWRKEY is already asserted, extend the pulse so the modem sees a single one
+        power_timer = g_timeout_add(pwrkey_pulse, G_SOURCE_FUNC(power_sequence_step), manager);
+    } else {
+        if (power_step == GPIO_POWER_DELAY)
+            g_message("Cancelled pending power-on sequence");
+        power_step = GPIO_POWER_IDLE;
+        power_sequence_start(manager, 0);
+    }
 
-    g_message("Executed power-off sequence");
+    at_trace_gpio(manager, "shutdown");
+    g_message("Started power-off sequence");
 
     return 0;
 }
 
 int gpio_sequence_suspend(struct EG25Manager *manager)
 {
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_APREADY], 1);
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_DTR], 1);
+    gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_APREADY) | GPIO_OUT_LINE(GPIO_OUT_DTR), 1);
+    dtr_sleep = TRUE;
+    dtr_woken = FALSE;
 
+    at_trace_gpio(manager, "suspend");
     g_message("Executed suspend sequence");
 
     return 0;
@@ -61,14 +201,120 @@ int gpio_sequence_suspend(struct EG25Manager *manager)
 
 int gpio_sequence_resume(struct EG25Manager *manager)
 {
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_APREADY], 0);
-    gpiod_line_set_value(manager->gpio_out[GPIO_OUT_DTR], 0);
+    gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_APREADY) | GPIO_OUT_LINE(GPIO_OUT_DTR), 0);
+    dtr_sleep = FALSE;
+    dtr_woken = FALSE;
 
+    at_trace_gpio(manager, "resume");
     g_message("Executed resume sequence");
 
     return 0;
 }
 
+/*
+ * Pull DTR low so the modem wakes up; returns FALSE if it isn't allowed to
+ * sleep in the first place, or has already been woken up
+ */
+gboolean gpio_modem_wake(struct EG25Manager *manager)
+{
+    if (!dtr_sleep || dtr_woken)
+        return FALSE;
+
+    gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_DTR), 0);
+    dtr_woken = TRUE;
+
+    at_trace_gpio(manager, "wake");
+
+    return TRUE;
+}
+
+// Let the modem go back to sleep after gpio_modem_wake()
+void gpio_modem_release(struct EG25Manager *manager)
+{
+    if (!dtr_woken)
+        return;
+
+    gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_DTR), 1);
+    dtr_woken = FALSE;
+
+    at_trace_gpio(manager, "release");
+}
+
+static gboolean gpio_status_event(gint fd, GIOCondition condition, gpointer data)
+{
+    struct EG25Manager *manager = data;
+    struct gpiod_line_event event;
+
+    if (gpiod_line_event_read(manager->gpio_in[GPIO_IN_STATUS], &event) < 0) {
+        g_warning("Unable to read STATUS GPIO event");
+        return G_SOURCE_CONTINUE;
+    }
+
+    // STATUS is low while the modem is powered on
+    g_message("STATUS is %s", event.event_type == GPIOD_LINE_EVENT_FALLING_EDGE ? "low" : "high");
+    modem_power_changed(manager, event.event_type == GPIOD_LINE_EVENT_FALLING_EDGE);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static enum ModemRiPulse ri_classify(gint64 width)
+{
+    if (width >= ri_ring_width[0] && width <= ri_ring_width[1])
+        return MODEM_RI_RING;
+    if (width >= ri_sms_width[0] && width <= ri_sms_width[1])
+        return MODEM_RI_SMS;
+
+    return MODEM_RI_OTHER;
+}
+
+static gboolean gpio_ri_event(gint fd, GIOCondition condition, gpointer data)
+{
+    struct EG25Manager *manager = data;
+    struct gpiod_line_event event;
+    gint64 timestamp, width;
+
+    if (gpiod_line_event_read(manager->gpio_in[GPIO_IN_RI], &event) < 0) {
+        g_warning("Unable to read RI GPIO event");
+        return G_SOURCE_CONTINUE;
+    }
+
+    // Event timestamps are used as we may only get to read events after resuming
+    timestamp = event.ts.tv_sec * G_USEC_PER_SEC + event.ts.tv_nsec / 1000;
+    if (event.event_type == GPIOD_LINE_EVENT_FALLING_EDGE) {
+        ri_pulse_start = timestamp;
+        return G_SOURCE_CONTINUE;
+    }
+
+    // The pulse started before we were watching
+    if (!ri_pulse_start)
+        return G_SOURCE_CONTINUE;
+
+    width = (timestamp - ri_pulse_start) / 1000;
+    ri_pulse_start = 0;
+    modem_ri_pulse(manager, ri_classify(width), (guint)width);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void get_config_range(toml_table_t *config, const char *id, gint64 range[2])
+{
+    toml_array_t *array = toml_array_in(config, id);
+    toml_datum_t min, max;
+
+    if (!array)
+        return;
+
+    min = toml_int_at(array, 0);
+    max = toml_int_at(array, 1);
+    if (toml_array_nelem(array) != 2 || !min.ok || !max.ok || min.u.i > max.u.i) {
+        g_warning("Invalid `%s` range, ignoring", id);
+        return;
+    }
+
+    range[0] = min.u.i;
+    range[1] = max.u.i;
+}
+
 static guint get_config_gpio(toml_table_t *config, const char *id)
 {
     toml_datum_t value = toml_int_in(config, id);
@@ -87,6 +333,7 @@ int gpio_init(struct EG25Manager *manager, toml_table_t *config)
     int i, ret;
     guint gpio_out_idx[GPIO_OUT_COUNT];
     guint gpio_in_idx[GPIO_IN_COUNT];
+    toml_datum_t pulse;
 
     manager->gpiochip[0] = gpiod_chip_open_by_label(GPIO_CHIP1_LABEL);
     if (!manager->gpiochip[0]) {
@@ -106,6 +353,16 @@ int gpio_init(struct EG25Manager *manager, toml_table_t *config)
     gpio_out_idx[GPIO_OUT_APREADY] = get_config_gpio(config, "apready");
     gpio_out_idx[GPIO_OUT_DISABLE] = get_config_gpio(config, "disable");
     gpio_in_idx[GPIO_IN_STATUS] = get_config_gpio(config, "status");
+    gpio_in_idx[GPIO_IN_RI] = get_config_gpio(config, "ri");
+    get_config_range(config, "ri_ring", ri_ring_width);
+    get_config_range(config, "ri_sms", ri_sms_width);
+
+    pulse = toml_int_in(config, "pwrkey_pulse");
+    if (pulse.ok && pulse.u.i > 0 && pulse.u.i <= G_MAXINT)
+        pwrkey_pulse = (guint)pulse.u.i;
+
+    gpiod_line_bulk_init(&gpio_out_bulk[0]);
+    gpiod_line_bulk_init(&gpio_out_bulk[1]);
 
     for (i = 0; i < GPIO_OUT_COUNT; i++) {
         guint offset, chipidx;
@@ -124,9 +381,19 @@ int gpio_init(struct EG25Manager *manager, toml_table_t *config)
             return 1;
         }
 
-        ret = gpiod_line_request_output(manager->gpio_out[i], "eg25manager", 0);
+        gpio_out_chip[i] = chipidx;
+        gpio_out_values[i] = 0;
+        gpiod_line_bulk_add(&gpio_out_bulk[chipidx], manager->gpio_out[i]);
+    }
+
+    for (i = 0; i < (int)G_N_ELEMENTS(gpio_out_bulk); i++) {
+        if (gpiod_line_bulk_num_lines(&gpio_out_bulk[i]) == 0)
+            continue;
+
+        // All lines start low, which gpio_out_values already reflects
+        ret = gpiod_line_request_bulk_output(&gpio_out_bulk[i], "eg25manager", NULL);
         if (ret < 0) {
-            g_error("Unable to request output GPIO %d", i);
+            g_error("Unable to request output GPIOs on chip %d", i);
             return 1;
         }
     }
@@ -151,6 +418,30 @@ int gpio_init(struct EG25Manager *manager, toml_table_t *config)
             continue;
         }
 
+        // STATUS changes are reported through events, falling back to polling
+        if (i == GPIO_IN_STATUS) {
+            ret = gpiod_line_request_both_edges_events(manager->gpio_in[i], "eg25manager");
+            if (ret == 0) {
+                status_source = g_unix_fd_add(gpiod_line_event_get_fd(manager->gpio_in[i]),
+                                              G_IO_IN, gpio_status_event, manager);
+                continue;
+            }
+            g_warning("Unable to request events for STATUS GPIO, falling back to polling");
+        }
+
+        // There's no point in polling RI, pulses are too short
+        if (i == GPIO_IN_RI) {
+            ret = gpiod_line_request_both_edges_events(manager->gpio_in[i], "eg25manager");
+            if (ret < 0) {
+                g_warning("Unable to request events for RI GPIO");
+                manager->gpio_in[i] = NULL;
+                continue;
+            }
+            ri_source = g_unix_fd_add(gpiod_line_event_get_fd(manager->gpio_in[i]),
+                                      G_IO_IN, gpio_ri_event, manager);
+            continue;
+        }
+
         ret = gpiod_line_request_input(manager->gpio_in[i], "eg25manager");
         if (ret < 0) {
             g_warning("Unable to request input GPIO %d", i);
@@ -168,7 +459,7 @@ gboolean gpio_check_poweroff(struct EG25Manager *manager, gboolean keep_down)
 
         if (keep_down && manager->gpio_out[GPIO_OUT_RESET]) {
             // Asserting RESET line to prevent modem from rebooting
-            gpiod_line_set_value(manager->gpio_out[GPIO_OUT_RESET], 1);
+            gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_RESET), 1);
         }
 
         return TRUE;
@@ -181,9 +472,27 @@ void gpio_destroy(struct EG25Manager *manager)
 {
     int i;
 
-    for (i = 0; i < GPIO_OUT_COUNT; i++) {
-        if (manager->gpio_out[i])
-            gpiod_line_release(manager->gpio_out[i]);
+    // Don't leave PWRKEY asserted
+    if (power_timer) {
+        g_source_remove(power_timer);
+        power_timer = 0;
+        if (power_step == GPIO_POWER_PULSE)
+            gpio_set_outputs(manager, GPIO_OUT_LINE(GPIO_OUT_PWRKEY), 0);
+        power_step = GPIO_POWER_IDLE;
+    }
+
+    if (status_source) {
+        g_source_remove(status_source);
+        status_source = 0;
+    }
+    if (ri_source) {
+        g_source_remove(ri_source);
+        ri_source = 0;
+    }
+
+    for (i = 0; i < (int)G_N_ELEMENTS(gpio_out_bulk); i++) {
+        if (gpiod_line_bulk_num_lines(&gpio_out_bulk[i]) > 0)
+            gpiod_line_release_bulk(&gpio_out_bulk[i]);
     }
 
     for (i = 0; i < GPIO_IN_COUNT; i++) {
@@ -16,4 +16,7 @@ int gpio_sequence_shutdown(struct EG25Manager *state);
 int gpio_sequence_suspend(struct EG25Manager *state);
 int gpio_sequence_resume(struct EG25Manager *state);
 
+gboolean gpio_modem_wake(struct EG25Manager *state);
+void gpio_modem_release(struct EG25Manager *state);
+
 gboolean gpio_check_poweroff(struct EG25Manager *manager, gboolean keep_down);
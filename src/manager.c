@@ -28,12 +28,109 @@
 #define EG25_DATADIR "/usr/share/eg25-manager"
 #endif
 
+/*
+ * While waiting for the modem to boot after powering it on, probe it with a
+ * bare "AT" every MODEM_PROBE_INTERVAL ms, up to MODEM_PROBE_COUNT times
+ */
+#define MODEM_PROBE_INTERVAL 1000
+#define MODEM_PROBE_TIMEOUT 500
+#define MODEM_PROBE_COUNT 60
+
+static guint probe_timer = 0;
+static guint probe_count = 0;
+
+static gboolean modem_probe(struct EG25Manager *manager);
+
+static void modem_probed(struct EG25Manager *manager,
+                         const char         *response,
+                         const char         *error,
+                         gpointer            user_data)
+{
+    // Booted through another path in the meantime
+    if (manager->modem_state != EG25_STATE_POWERED)
+        return;
+
+    if (!error) {
+        modem_started(manager, "AT probe");
+    } else if (g_strcmp0(error, "CANCELLED") != 0 && probe_count < MODEM_PROBE_COUNT &&
+               !probe_timer) {
+        probe_timer = g_timeout_add(MODEM_PROBE_INTERVAL, G_SOURCE_FUNC(modem_probe), manager);
+    }
+}
+
+static gboolean modem_probe(struct EG25Manager *manager)
+{
+    probe_timer = 0;
+
+    if (manager->modem_state != EG25_STATE_POWERED)
+        return G_SOURCE_REMOVE;
+
+    probe_count++;
+    if (!at_request_async(manager, "", MODEM_PROBE_TIMEOUT, modem_probed, NULL))
+        g_warning("Unable to probe the modem");
+
+    return G_SOURCE_REMOVE;
+}
+
+static void modem_probe_start(struct EG25Manager *manager)
+{
+    if (probe_timer)
+        g_source_remove(probe_timer);
+
+    probe_count = 0;
+    probe_timer = g_timeout_add(MODEM_PROBE_INTERVAL, G_SOURCE_FUNC(modem_probe), manager);
+}
+
+// Time (in seconds) we give the modem to power down before quitting anyway
+#define MODEM_POWEROFF_TIMEOUT 30
+
+static void modem_poweroff_done(struct EG25Manager *manager)
+{
+    if (manager->poweroff_timer) {
+        g_source_remove(manager->poweroff_timer);
+        manager->poweroff_timer = 0;
+    }
+
+    g_message("Modem down, quitting...");
+    g_main_loop_quit(manager->loop);
+}
+
+/*
+ * STATUS edges usually tell us when the modem is down, this is only a
+ * fallback in case those aren't available, and enforces the timeout
+ */
+static gboolean modem_poweroff_wait(struct EG25Manager *manager)
+{
+    static guint elapsed = 0;
+
+    if (!gpio_check_poweroff(manager, TRUE) && ++elapsed < MODEM_POWEROFF_TIMEOUT)
+        return G_SOURCE_CONTINUE;
+
+    manager->poweroff_timer = 0;
+    modem_poweroff_done(manager);
+
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Signal handlers stay installed until we exit, so further signals don't kill
+ * us while the modem is powering down; those are simply ignored
+ */
 static gboolean quit_app(struct EG25Manager *manager)
 {
-    int i;
+    static gboolean quitting = FALSE;
+
+    if (quitting)
+        return G_SOURCE_CONTINUE;
+    quitting = TRUE;
 
     g_message("Request to quit...");
 
+    if (probe_timer) {
+        g_source_remove(probe_timer);
+        probe_timer = 0;
+    }
+
     at_destroy(manager);
     mm_iface_destroy(manager);
     ofono_iface_destroy(manager);
@@ -44,17 +141,16 @@ static gboolean quit_app(struct EG25Manager *manager)
         g_message("Powering down the modem...");
         gpio_sequence_shutdown(manager);
         manager->modem_state = EG25_STATE_FINISHING;
-        for (i = 0; i < 30; i++) {
-            if (gpio_check_poweroff(manager, TRUE))
-                break;
-            sleep(1);
-        }
+        // Keep the main loop running so the power-off sequence can complete
+        manager->poweroff_timer = g_timeout_add_seconds(1, G_SOURCE_FUNC(modem_poweroff_wait),
+                                                        manager);
+        return G_SOURCE_CONTINUE;
     }
     g_message("Modem down, quitting...");
 
     g_main_loop_quit(manager->loop);
 
-    return FALSE;
+    return G_SOURCE_CONTINUE;
 }
 
 static gboolean modem_start(struct EG25Manager *manager)
@@ -88,11 +184,9 @@ static gboolean modem_start(struct EG25Manager *manager)
 
     if (should_boot) {
         g_message("Starting modem...");
-        // Modem might crash on boot (especially with worn battery) if we don't delay here
-        if (manager->poweron_delay > 0)
-            g_usleep(manager->poweron_delay);
         gpio_sequence_poweron(manager);
         manager->modem_state = EG25_STATE_POWERED;
+        modem_probe_start(manager);
     } else {
         manager->modem_state = EG25_STATE_STARTED;
     }
@@ -117,6 +211,117 @@ void modem_update_state(struct EG25Manager *manager, MMModemState state)
     }
 }
 
+/*
+ * The modem boot is detected through STATUS going low, the modem answering
+ * an AT probe or sending RDY, whichever comes first. RDY is also sent when
+ * the modem reboots on its own, hence not only being handled while powered.
+ */
+void modem_started(struct EG25Manager *manager, const char *source)
+{
+    if (manager->modem_state == EG25_STATE_STARTED) {
+        g_message("Modem start confirmed (%s)", source);
+        return;
+    }
+
+    g_message("Modem started (%s)", source);
+    suspend_inhibit(manager, TRUE, TRUE);
+    manager->modem_state = EG25_STATE_STARTED;
+}
+
+/*
+ * Called when the STATUS line changes, `powered` being TRUE if the modem has
+ * just been powered on
+ */
+void modem_power_changed(struct EG25Manager *manager, gboolean powered)
+{
+    switch (manager->modem_state) {
+    case EG25_STATE_INIT:
+        // modem_start() hasn't checked STATUS yet, it will do so by itself
+        break;
+    case EG25_STATE_POWERED:
+        if (powered)
+            modem_started(manager, "STATUS");
+        break;
+    case EG25_STATE_RESETTING:
+        // The modem may power-cycle while rebooting
+        break;
+    case EG25_STATE_FINISHING:
+        if (!powered) {
+            // Asserts RESET so the modem doesn't boot again
+            gpio_check_poweroff(manager, TRUE);
+            modem_poweroff_done(manager);
+        }
+        break;
+    default:
+        if (!powered) {
+            g_warning("Modem powered down unexpectedly, powering it on again");
+            gpio_sequence_poweron(manager);
+            manager->modem_state = EG25_STATE_POWERED;
+            modem_probe_start(manager);
+        }
+        break;
+    }
+}
+
+/*
+ * Time at which the last incoming call was signaled through RI, used to
+ * measure how long it takes for the corresponding URC to come through
+ */
+static gint64 ring_time = 0;
+
+/*
+ * Called for each pulse on the RI line: incoming calls must get through as
+ * fast as possible, even if the system was suspended
+ */
+void modem_ri_pulse(struct EG25Manager *manager, enum ModemRiPulse pulse, guint width)
+{
+    switch (pulse) {
+    case MODEM_RI_RING:
+        if (manager->resume_time)
+            g_message("Incoming call signaled %" G_GINT64_FORMAT " ms after resuming",
+                      (g_get_monotonic_time() - manager->resume_time) / 1000);
+        else
+            g_message("Incoming call signaled");
+        manager->resume_time = 0;
+        ring_time = g_get_monotonic_time();
+
+        suspend_hold_ring(manager);
+        /*
+         * Don't wait for ModemManager, URCs are cached until the resume
+         * sequence runs; leaving RESUMING makes sure it only runs once, as
+         * the modem being probed again would otherwise queue it once more
+         */
+        if (manager->modem_state == EG25_STATE_RESUMING) {
+            g_message("Fast-tracking resume sequence");
+            if (manager->modem_recovery_timer) {
+                g_source_remove(manager->modem_recovery_timer);
+                manager->modem_recovery_timer = 0;
+            }
+            modem_resume_post(manager);
+            manager->modem_state = EG25_STATE_CONFIGURED;
+        }
+        break;
+    case MODEM_RI_SMS:
+        g_message("Incoming SMS signaled");
+        break;
+    default:
+        g_message("RI pulse of %u ms", width);
+        break;
+    }
+}
+
+static void modem_ring_urc(struct EG25Manager *manager,
+                           const char         *urc,
+                           gpointer            user_data)
+{
+    if (!ring_time)
+        return;
+
+    g_message("Incoming call reported %" G_GINT64_FORMAT " ms after being signaled",
+              (g_get_monotonic_time() - ring_time) / 1000);
+    ring_time = 0;
+}
+
 void modem_configure(struct EG25Manager *manager)
 {
     at_sequence_configure(manager);
@@ -190,7 +395,8 @@ error:
         g_source_remove(manager->modem_boot_timer);
         manager->modem_boot_timer = 0;
     }
-    // Everything else failed, reboot the modem
+    // Everything else failed, reboot the modem; STATUS will go up and down meanwhile
+    manager->modem_state = EG25_STATE_RESETTING;
     at_sequence_reset(manager);
 }
 
@@ -327,6 +533,7 @@ int main(int argc, char *argv[])
     }
 
     at_init(&manager, toml_table_in(toml_config, "at"));
+    at_urc_subscribe("RING", modem_ring_urc, NULL);
     gpio_init(&manager, toml_table_in(toml_config, "gpio"));
     mm_iface_init(&manager, toml_table_in(toml_config, "mm-iface"));
     ofono_iface_init(&manager);
@@ -28,6 +28,13 @@ enum EG25State {
     EG25_STATE_FINISHING
 };
 
+// Kind of event signaled by the modem through a pulse on its RI line
+enum ModemRiPulse {
+    MODEM_RI_RING = 0,
+    MODEM_RI_SMS,
+    MODEM_RI_OTHER
+};
+
 enum ModemIface {
     MODEM_IFACE_NONE = 0,
     MODEM_IFACE_MODEMMANAGER,
@@ -37,6 +44,7 @@ enum ModemIface {
 struct EG25Manager {
     GMainLoop *loop;
     guint reset_timer;
+    guint poweroff_timer;
     gboolean use_libusb;
     guint usb_vid;
     guint usb_pid;
@@ -44,10 +52,14 @@ struct EG25Manager {
 
     int at_fd;
     guint at_source;
-    GList *at_cmds;
+    guint at_write_source;
+    guint at_timeout_timer;
+    guint at_retry_timer;
 
     enum EG25State modem_state;
     gchar *modem_usb_id;
+    gchar *modem_firmware;
+    gchar *modem_imei;
 
     enum ModemIface modem_iface;
     guint mm_watch;
@@ -61,11 +73,14 @@ struct EG25Manager {
     GDBusProxy *suspend_proxy;
     int suspend_delay_fd;
     int suspend_block_fd;
+    gint64 resume_time;
 
     guint modem_recovery_timer;
     guint modem_recovery_timeout;
     guint modem_boot_timer;
     guint modem_boot_timeout;
+    guint modem_ring_timer;
+    guint modem_ring_timeout;
 
     GUdevClient *udev;
 
@@ -81,3 +96,6 @@ void modem_suspend_post(struct EG25Manager *data);
 void modem_resume_pre(struct EG25Manager *data);
 void modem_resume_post(struct EG25Manager *data);
 void modem_update_state(struct EG25Manager *data, MMModemState state);
+void modem_started(struct EG25Manager *data, const char *source);
+void modem_power_changed(struct EG25Manager *data, gboolean powered);
+void modem_ri_pulse(struct EG25Manager *data, enum ModemRiPulse pulse, guint width);
@@ -113,22 +113,43 @@ static gboolean modem_fully_booted(struct EG25Manager *manager)
     return FALSE;
 }
 
-static void take_inhibitor(struct EG25Manager *manager, gboolean block)
+static gboolean modem_ring_done(struct EG25Manager *manager)
+{
+    g_message("Incoming call had %u seconds to come through", manager->modem_ring_timeout);
+    manager->modem_ring_timer = 0;
+    // The inhibitor may have been taken over by a modem boot meanwhile
+    if (!manager->modem_boot_timer)
+        drop_inhibitor(manager, TRUE);
+
+    return FALSE;
+}
+
+static void take_block_inhibitor(struct EG25Manager *manager, const char *why)
 {
     GVariant *variant_arg;
 
-    if (block) {
-        if(manager->suspend_block_fd != -1)
-            drop_inhibitor(manager, TRUE);
+    if(manager->suspend_block_fd != -1)
+        drop_inhibitor(manager, TRUE);
 
-        variant_arg = g_variant_new ("(ssss)", "sleep", "eg25manager",
-                                     "eg25manager needs to wait for modem to be fully booted",
-                                     "block");
+    variant_arg = g_variant_new ("(ssss)", "sleep", "eg25manager", why, "block");
 
-        g_message("taking systemd sleep inhibitor (blocking)");
-        g_dbus_proxy_call_with_unix_fd_list(manager->suspend_proxy, "Inhibit",
-                                            variant_arg, 0, G_MAXINT, NULL, NULL,
-                                            inhibit_done_block, manager);
+    g_message("taking systemd sleep inhibitor (blocking)");
+    g_dbus_proxy_call_with_unix_fd_list(manager->suspend_proxy, "Inhibit",
+                                        variant_arg, 0, G_MAXINT, NULL, NULL,
+                                        inhibit_done_block, manager);
+}
+
+static void take_inhibitor(struct EG25Manager *manager, gboolean block)
+{
+    GVariant *variant_arg;
+
+    if (block) {
+        // The boot hold lasts longer than any pending ring hold
+        if (manager->modem_ring_timer) {
+            g_source_remove(manager->modem_ring_timer);
+            manager->modem_ring_timer = 0;
+        }
+        take_block_inhibitor(manager, "eg25manager needs to wait for modem to be fully booted");
         manager->modem_boot_timer = g_timeout_add_seconds(manager->modem_boot_timeout,
                                                           G_SOURCE_FUNC(modem_fully_booted),
                                                           manager);
@@ -164,10 +185,12 @@ static void signal_cb(GDBusProxy *proxy,
 
     if (is_about_to_suspend) {
         g_message("system is about to suspend");
+        manager->resume_time = 0;
         manager->modem_state = EG25_STATE_SUSPENDING;
         modem_suspend_pre(manager);
     } else {
         g_message("system is resuming");
+        manager->resume_time = g_get_monotonic_time();
         take_inhibitor(manager, FALSE);
         modem_resume_pre(manager);
         if (manager->mm_modem || manager->modem_iface == MODEM_IFACE_OFONO) {
@@ -246,12 +269,18 @@ void suspend_init(struct EG25Manager *manager, toml_table_t *config)
         timeout_value = toml_int_in(config, "recovery_timeout");
         if (timeout_value.ok)
             manager->modem_recovery_timeout = (guint)timeout_value.u.i;
+
+        timeout_value = toml_int_in(config, "ring_timeout");
+        if (timeout_value.ok)
+            manager->modem_ring_timeout = (guint)timeout_value.u.i;
     }
 
     if (manager->modem_boot_timeout == 0)
         manager->modem_boot_timeout = 120;
     if (manager->modem_recovery_timeout == 0)
         manager->modem_recovery_timeout = 9;
+    if (manager->modem_ring_timeout == 0)
+        manager->modem_ring_timeout = 10;
 
     g_dbus_proxy_new_for_bus(G_BUS_TYPE_SYSTEM,
                              G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START |
@@ -272,6 +301,10 @@ void suspend_destroy(struct EG25Manager *manager)
         g_source_remove(manager->modem_boot_timer);
         manager->modem_boot_timer = 0;
     }
+    if (manager->modem_ring_timer) {
+        g_source_remove(manager->modem_ring_timer);
+        manager->modem_ring_timer = 0;
+    }
     if (manager->suspend_proxy) {
         g_object_unref(manager->suspend_proxy);
         manager->suspend_proxy = NULL;
@@ -285,3 +318,23 @@ void suspend_inhibit(struct EG25Manager *manager, gboolean inhibit, gboolean blo
     else
         drop_inhibitor(manager, block);
 }
+
+/*
+ * Prevent the system from suspending again for a few seconds after an
+ * incoming call has been signaled, unless suspend is already blocked for
+ * longer (e.g. because the modem just booted)
+ */
+void suspend_hold_ring(struct EG25Manager *manager)
+{
+    if (manager->modem_ring_timer) {
+        g_source_remove(manager->modem_ring_timer);
+    } else {
+        if (manager->modem_boot_timer || !manager->suspend_proxy)
+            return;
+        take_block_inhibitor(manager, "eg25manager needs to wait for the incoming call to be set up");
+    }
+
+    manager->modem_ring_timer = g_timeout_add_seconds(manager->modem_ring_timeout,
+                                                      G_SOURCE_FUNC(modem_ring_done),
+                                                      manager);
+}
@@ -12,3 +12,4 @@ void suspend_init (struct EG25Manager *data, toml_table_t *config);
 void suspend_destroy (struct EG25Manager *data);
 
 void suspend_inhibit (struct EG25Manager *data, gboolean inhibit, gboolean block);
+void suspend_hold_ring (struct EG25Manager *data);